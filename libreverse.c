@@ -0,0 +1,1080 @@
+/* libreverse - see libreverse.h for the interface.
+ *
+ * This is the part of reverse.c that actually reverses things: the SIMD
+ * kernels, the newline scanners, UTF-8 units, and the record logic on top of
+ * them. reverse.c is now just one caller of it, and the file, pipe, thread
+ * and io_uring machinery stays over there. Same bottom-to-top order as the
+ * rest of the project, so the public functions are at the end.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#include "libreverse.h"
+
+// The reversal kernels. There are two shapes: reverse_copy() writes the
+// reverse of src into dst (the mmap path, where the source is read-only), and
+// reverse_in_place() flips a buffer on itself (the getline() path).
+//
+// Lines come in very different sizes, and a loop that suits a 64K blob spends
+// most of a 20-byte log line on its own overhead. So every kernel starts by
+// sorting the length into a class. Anything up to twice a register's width is
+// done with no loop at all: the first and the last register's worth are
+// loaded, possibly overlapping, and each is stored reversed at the other end.
+// Both loads happen before either store, so that works in place as well.
+// Longer lines get an unrolled loop, and its tail is one of the short cases
+// again. Under 16 bytes this is done with byte swaps in ordinary registers,
+// which every kernel shares: 8 to 16 bytes as two 8-byte swaps, 4 to 8 as two
+// 4-byte swaps, and 2 or 3 by moving the end bytes. The cut-offs fall where
+// the register widths put them. On lines under 64 bytes this about doubles
+// the speed of the old loops, which spent most of their time in the
+// byte-at-a-time tail.
+static inline uint64_t load_64(const char *from) {
+    uint64_t word;
+    memcpy(&word, from, 8);
+    return word;
+}
+
+static inline void store_64(char *to, uint64_t word) {
+    memcpy(to, &word, 8);
+}
+
+static inline uint32_t load_32(const char *from) {
+    uint32_t word;
+    memcpy(&word, from, 4);
+    return word;
+}
+
+static inline void store_32(char *to, uint32_t word) {
+    memcpy(to, &word, 4);
+}
+
+static inline void reverse_short(char *dst, const char *src, size_t length) {
+    if (length >= 8) {
+        uint64_t head = load_64(src), tail = load_64(src + length - 8);
+        store_64(dst, __builtin_bswap64(tail));
+        store_64(dst + length - 8, __builtin_bswap64(head));
+    } else if (length >= 4) {
+        uint32_t head = load_32(src), tail = load_32(src + length - 4);
+        store_32(dst, __builtin_bswap32(tail));
+        store_32(dst + length - 4, __builtin_bswap32(head));
+    } else if (length >= 2) {
+        char first = src[0], middle = src[length / 2], last = src[length - 1];
+        dst[0] = last;
+        dst[length / 2] = middle;
+        dst[length - 1] = first;
+    } else if (length) {
+        dst[0] = src[0];
+    }
+}
+
+// Without vectors, the long case goes 8 bytes at a time.
+static void reverse_copy_scalar(char *dst, const char *src, size_t length) {
+    const char *end = src + length;
+    while (end - src >= 16) {
+        end -= 8;
+        store_64(dst, __builtin_bswap64(load_64(end)));
+        dst += 8;
+    }
+    reverse_short(dst, src, end - src);
+}
+
+static void reverse_in_place_scalar(char *buffer, size_t length) {
+    char *left = buffer;
+    char *right = buffer + length;
+    while (right - left >= 16) {
+        right -= 8;
+        uint64_t head = load_64(left), tail = load_64(right);
+        store_64(left, __builtin_bswap64(tail));
+        store_64(right, __builtin_bswap64(head));
+        left += 8;
+    }
+    reverse_short(left, left, right - left);
+}
+
+// On x86, pshufb reverses the bytes within a 16-byte register in a single
+// instruction. AVX2's vpshufb only shuffles within each 128-bit lane, so the
+// 32-byte version also swaps the two lanes afterwards. Both are compiled with
+// target attributes so the rest of the file doesn't need -mavx2, and
+// select_kernels() only picks them when the CPU has them. The long loops do
+// four registers a turn; beyond a few hundred bytes a line is limited by
+// memory rather than by the loop.
+#ifdef HAVE_X86_KERNELS
+#define REVERSE_16_MASK \
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+
+__attribute__((target("ssse3")))
+static inline __m128i reverse_16(__m128i bytes) {
+    return _mm_shuffle_epi8(bytes, _mm_setr_epi8(REVERSE_16_MASK));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reverse_32(__m256i bytes) {
+    bytes = _mm256_shuffle_epi8(bytes,
+        _mm256_setr_epi8(REVERSE_16_MASK, REVERSE_16_MASK));
+    return _mm256_permute4x64_epi64(bytes, 0x4E);
+}
+
+// 16 to 32 bytes.
+__attribute__((target("ssse3")))
+static inline void reverse_pair_16(char *dst, const char *src, size_t length) {
+    __m128i head = _mm_loadu_si128((const __m128i *)src);
+    __m128i tail = _mm_loadu_si128((const __m128i *)(src + length - 16));
+    _mm_storeu_si128((__m128i *)dst, reverse_16(tail));
+    _mm_storeu_si128((__m128i *)(dst + length - 16), reverse_16(head));
+}
+
+// 32 to 64 bytes.
+__attribute__((target("avx2")))
+static inline void reverse_pair_32(char *dst, const char *src, size_t length) {
+    __m256i head = _mm256_loadu_si256((const __m256i *)src);
+    __m256i tail = _mm256_loadu_si256((const __m256i *)(src + length - 32));
+    _mm256_storeu_si256((__m256i *)dst, reverse_32(tail));
+    _mm256_storeu_si256((__m256i *)(dst + length - 32), reverse_32(head));
+}
+
+__attribute__((target("ssse3")))
+static inline void reverse_upto_32(char *dst, const char *src, size_t length) {
+    if (length >= 16)
+        reverse_pair_16(dst, src, length);
+    else
+        reverse_short(dst, src, length);
+}
+
+__attribute__((target("avx2")))
+static inline void reverse_upto_64(char *dst, const char *src, size_t length) {
+    if (length >= 32)
+        reverse_pair_32(dst, src, length);
+    else
+        reverse_upto_32(dst, src, length);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_copy_ssse3(char *dst, const char *src, size_t length) {
+    const char *end = src + length;
+    while (end - src >= 64) {
+        end -= 64;
+        __m128i a = _mm_loadu_si128((const __m128i *)end);
+        __m128i b = _mm_loadu_si128((const __m128i *)(end + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(end + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(end + 48));
+        _mm_storeu_si128((__m128i *)dst, reverse_16(d));
+        _mm_storeu_si128((__m128i *)(dst + 16), reverse_16(c));
+        _mm_storeu_si128((__m128i *)(dst + 32), reverse_16(b));
+        _mm_storeu_si128((__m128i *)(dst + 48), reverse_16(a));
+        dst += 64;
+    }
+    while (end - src > 32) {
+        end -= 16;
+        __m128i bytes = _mm_loadu_si128((const __m128i *)end);
+        _mm_storeu_si128((__m128i *)dst, reverse_16(bytes));
+        dst += 16;
+    }
+    reverse_upto_32(dst, src, end - src);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_in_place_ssse3(char *buffer, size_t length) {
+    char *left = buffer;
+    char *right = buffer + length;
+    while (right - left >= 64) {
+        right -= 32;
+        __m128i a = _mm_loadu_si128((const __m128i *)left);
+        __m128i b = _mm_loadu_si128((const __m128i *)(left + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)right);
+        __m128i d = _mm_loadu_si128((const __m128i *)(right + 16));
+        _mm_storeu_si128((__m128i *)left, reverse_16(d));
+        _mm_storeu_si128((__m128i *)(left + 16), reverse_16(c));
+        _mm_storeu_si128((__m128i *)right, reverse_16(b));
+        _mm_storeu_si128((__m128i *)(right + 16), reverse_16(a));
+        left += 32;
+    }
+    if (right - left > 32) {
+        right -= 16;
+        __m128i head = _mm_loadu_si128((const __m128i *)left);
+        __m128i tail = _mm_loadu_si128((const __m128i *)right);
+        _mm_storeu_si128((__m128i *)left, reverse_16(tail));
+        _mm_storeu_si128((__m128i *)right, reverse_16(head));
+        left += 16;
+    }
+    reverse_upto_32(left, left, right - left);
+}
+
+__attribute__((target("avx2")))
+static void reverse_copy_avx2(char *dst, const char *src, size_t length) {
+    const char *end = src + length;
+    while (end - src >= 128) {
+        end -= 128;
+        __m256i a = _mm256_loadu_si256((const __m256i *)end);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(end + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(end + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(end + 96));
+        _mm256_storeu_si256((__m256i *)dst, reverse_32(d));
+        _mm256_storeu_si256((__m256i *)(dst + 32), reverse_32(c));
+        _mm256_storeu_si256((__m256i *)(dst + 64), reverse_32(b));
+        _mm256_storeu_si256((__m256i *)(dst + 96), reverse_32(a));
+        dst += 128;
+    }
+    while (end - src > 64) {
+        end -= 32;
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)end);
+        _mm256_storeu_si256((__m256i *)dst, reverse_32(bytes));
+        dst += 32;
+    }
+    reverse_upto_64(dst, src, end - src);
+}
+
+__attribute__((target("avx2")))
+static void reverse_in_place_avx2(char *buffer, size_t length) {
+    char *left = buffer;
+    char *right = buffer + length;
+    while (right - left >= 128) {
+        right -= 64;
+        __m256i a = _mm256_loadu_si256((const __m256i *)left);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(left + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)right);
+        __m256i d = _mm256_loadu_si256((const __m256i *)(right + 32));
+        _mm256_storeu_si256((__m256i *)left, reverse_32(d));
+        _mm256_storeu_si256((__m256i *)(left + 32), reverse_32(c));
+        _mm256_storeu_si256((__m256i *)right, reverse_32(b));
+        _mm256_storeu_si256((__m256i *)(right + 32), reverse_32(a));
+        left += 64;
+    }
+    if (right - left > 64) {
+        right -= 32;
+        __m256i head = _mm256_loadu_si256((const __m256i *)left);
+        __m256i tail = _mm256_loadu_si256((const __m256i *)right);
+        _mm256_storeu_si256((__m256i *)left, reverse_32(tail));
+        _mm256_storeu_si256((__m256i *)right, reverse_32(head));
+        left += 32;
+    }
+    reverse_upto_64(left, left, right - left);
+}
+#endif
+
+// NEON is part of the baseline on AArch64, so there's nothing to detect at
+// runtime. vrev64 reverses each 8-byte half and vext swaps the halves.
+#ifdef HAVE_NEON_KERNELS
+static inline uint8x16_t reverse_16(uint8x16_t bytes) {
+    bytes = vrev64q_u8(bytes);
+    return vextq_u8(bytes, bytes, 8);
+}
+
+// 16 to 32 bytes, or fewer through reverse_short().
+static inline void reverse_upto_32(char *dst, const char *src, size_t length) {
+    if (length < 16) {
+        reverse_short(dst, src, length);
+        return;
+    }
+    uint8x16_t head = vld1q_u8((const uint8_t *)src);
+    uint8x16_t tail = vld1q_u8((const uint8_t *)(src + length - 16));
+    vst1q_u8((uint8_t *)dst, reverse_16(tail));
+    vst1q_u8((uint8_t *)(dst + length - 16), reverse_16(head));
+}
+
+static void reverse_copy_neon(char *dst, const char *src, size_t length) {
+    const char *end = src + length;
+    while (end - src >= 64) {
+        end -= 64;
+        uint8x16_t a = vld1q_u8((const uint8_t *)end);
+        uint8x16_t b = vld1q_u8((const uint8_t *)(end + 16));
+        uint8x16_t c = vld1q_u8((const uint8_t *)(end + 32));
+        uint8x16_t d = vld1q_u8((const uint8_t *)(end + 48));
+        vst1q_u8((uint8_t *)dst, reverse_16(d));
+        vst1q_u8((uint8_t *)(dst + 16), reverse_16(c));
+        vst1q_u8((uint8_t *)(dst + 32), reverse_16(b));
+        vst1q_u8((uint8_t *)(dst + 48), reverse_16(a));
+        dst += 64;
+    }
+    while (end - src > 32) {
+        end -= 16;
+        uint8x16_t bytes = vld1q_u8((const uint8_t *)end);
+        vst1q_u8((uint8_t *)dst, reverse_16(bytes));
+        dst += 16;
+    }
+    reverse_upto_32(dst, src, end - src);
+}
+
+static void reverse_in_place_neon(char *buffer, size_t length) {
+    char *left = buffer;
+    char *right = buffer + length;
+    while (right - left > 32) {
+        right -= 16;
+        uint8x16_t head = vld1q_u8((const uint8_t *)left);
+        uint8x16_t tail = vld1q_u8((const uint8_t *)right);
+        vst1q_u8((uint8_t *)left, reverse_16(tail));
+        vst1q_u8((uint8_t *)right, reverse_16(head));
+        left += 16;
+    }
+    reverse_upto_32(left, left, right - left);
+}
+#endif
+
+// The newline scanners. Each one records the offset just past every delimiter
+// ('\n' unless -d says otherwise) in block, stopping early once max_ends have
+// been found, and returns how many it recorded. The vector versions compare a
+// whole register against the delimiter at once and turn the result into a
+// bitmask, so the cost is one compare per 16 or 32
+// bytes plus one step per newline actually found. The scalar version leans on
+// memchr, which the C library already vectorizes on most platforms.
+static size_t find_line_ends_scalar(const char *block, size_t length,
+                                    char delimiter, size_t *ends,
+                                    size_t max_ends) {
+    size_t count = 0;
+    const char *cursor = block;
+    const char *end = block + length;
+    while (count < max_ends && cursor < end) {
+        const char *newline = memchr(cursor, delimiter, end - cursor);
+        if (!newline) break;
+        cursor = newline + 1;
+        ends[count++] = cursor - block;
+    }
+    return count;
+}
+
+// Pulls every set bit out of a compare mask as an end offset, and finishes off
+// the last few bytes that don't fill a register. Shared by the vector
+// scanners; base is the offset of the mask's first byte in the block.
+#define RECORD_MASK_ENDS(mask, base)                       \
+    while (mask) {                                         \
+        ends[count++] = (base) + __builtin_ctzll(mask) + 1; \
+        if (count == max_ends) return count;               \
+        mask &= mask - 1;                                  \
+    }
+
+#define RECORD_TAIL_ENDS(offset)                           \
+    for (; offset < length && count < max_ends; offset++)  \
+        if (block[offset] == delimiter) ends[count++] = offset + 1;
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static size_t find_line_ends_sse2(const char *block, size_t length,
+                                  char delimiter, size_t *ends,
+                                  size_t max_ends) {
+    if (!max_ends) return 0;
+
+    const __m128i newline = _mm_set1_epi8(delimiter);
+    size_t count = 0;
+    size_t offset = 0;
+    for (; offset + 16 <= length; offset += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + offset));
+        unsigned long long mask =
+            (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        RECORD_MASK_ENDS(mask, offset);
+    }
+    RECORD_TAIL_ENDS(offset);
+    return count;
+}
+
+__attribute__((target("avx2")))
+static size_t find_line_ends_avx2(const char *block, size_t length,
+                                  char delimiter, size_t *ends,
+                                  size_t max_ends) {
+    if (!max_ends) return 0;
+
+    const __m256i newline = _mm256_set1_epi8(delimiter);
+    size_t count = 0;
+    size_t offset = 0;
+    for (; offset + 32 <= length; offset += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + offset));
+        unsigned long long mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, newline));
+        RECORD_MASK_ENDS(mask, offset);
+    }
+    RECORD_TAIL_ENDS(offset);
+    return count;
+}
+#endif
+
+// NEON has no movemask. Narrowing the compare result by 4 bits per byte gives
+// a 64-bit mask instead, so each byte owns a nibble and the bit index has to
+// be divided by 4. Clearing a whole nibble at a time keeps the shared macro
+// usable.
+#ifdef HAVE_NEON_KERNELS
+static size_t find_line_ends_neon(const char *block, size_t length,
+                                  char delimiter, size_t *ends,
+                                  size_t max_ends) {
+    if (!max_ends) return 0;
+
+    const uint8x16_t newline = vdupq_n_u8(delimiter);
+    size_t count = 0;
+    size_t offset = 0;
+    for (; offset + 16 <= length; offset += 16) {
+        uint8x16_t hits = vceqq_u8(vld1q_u8((const uint8_t *)block + offset),
+                                   newline);
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+        while (nibbles) {
+            ends[count++] = offset + (__builtin_ctzll(nibbles) >> 2) + 1;
+            if (count == max_ends) return count;
+            nibbles &= ~(0xFULL << (__builtin_ctzll(nibbles) & ~3));
+        }
+    }
+    RECORD_TAIL_ENDS(offset);
+    return count;
+}
+#endif
+
+// The ASCII checks for --utf8. A block with no high bits set can only hold
+// single-byte characters, so it goes straight to the byte kernels. The vector
+// versions OR everything together and look at the top bits once at the end.
+static _Bool is_ascii_scalar(const char *block, size_t length) {
+    uint64_t bits = 0;
+    size_t offset = 0;
+    for (; offset + 8 <= length; offset += 8) {
+        uint64_t word;
+        memcpy(&word, block + offset, 8);
+        bits |= word;
+    }
+    for (; offset < length; offset++) bits |= (unsigned char)block[offset];
+    return !(bits & 0x8080808080808080ULL);
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static _Bool is_ascii_sse2(const char *block, size_t length) {
+    __m128i bits = _mm_setzero_si128();
+    size_t offset = 0;
+    for (; offset + 16 <= length; offset += 16)
+        bits = _mm_or_si128(bits,
+            _mm_loadu_si128((const __m128i *)(block + offset)));
+    return !_mm_movemask_epi8(bits)
+           && is_ascii_scalar(block + offset, length - offset);
+}
+
+__attribute__((target("avx2")))
+static _Bool is_ascii_avx2(const char *block, size_t length) {
+    __m256i bits = _mm256_setzero_si256();
+    size_t offset = 0;
+    for (; offset + 32 <= length; offset += 32)
+        bits = _mm256_or_si256(bits,
+            _mm256_loadu_si256((const __m256i *)(block + offset)));
+    return !_mm256_movemask_epi8(bits)
+           && is_ascii_scalar(block + offset, length - offset);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static _Bool is_ascii_neon(const char *block, size_t length) {
+    uint8x16_t bits = vdupq_n_u8(0);
+    size_t offset = 0;
+    for (; offset + 16 <= length; offset += 16)
+        bits = vorrq_u8(bits, vld1q_u8((const uint8_t *)block + offset));
+    return vmaxvq_u8(bits) < 0x80
+           && is_ascii_scalar(block + offset, length - offset);
+}
+#endif
+
+static void (*reverse_copy)(char *, const char *, size_t) = reverse_copy_scalar;
+static void (*reverse_in_place)(char *, size_t) = reverse_in_place_scalar;
+static size_t (*find_line_ends)(const char *, size_t, char, size_t *, size_t) =
+    find_line_ends_scalar;
+static _Bool (*is_ascii)(const char *, size_t) = is_ascii_scalar;
+
+// --utf8 reverses characters instead of bytes, and --utf8=graphemes goes one
+// step further and keeps combining marks, emoji modifiers, ZWJ sequences and
+// flag pairs attached to the character they belong to. That's an
+// approximation of Unicode's extended grapheme clusters that covers the cases
+// that actually show up in logs, without dragging in the full property
+// tables.
+//
+// A unit is what gets reversed as a whole: a byte, a code point or a grapheme
+// cluster, depending on the mode. A code point is any byte that isn't a
+// continuation byte, plus every continuation byte after it. Malformed input
+// still splits into units that way, so every byte comes out the other side
+// and the line keeps its length.
+#define IS_CONTINUATION(byte) (((unsigned char)(byte) & 0xC0) == 0x80)
+
+static size_t code_point_end(const char *text, size_t offset, size_t length) {
+    offset++;
+    while (offset < length && IS_CONTINUATION(text[offset])) offset++;
+    return offset;
+}
+
+// Decodes without validating; the units are already decided by
+// code_point_end(), this is only for looking up what a code point is.
+static unsigned long decode_code_point(const char *text, size_t offset,
+                                       size_t end) {
+    unsigned char lead = text[offset];
+    if (lead < 0x80 || end - offset == 1) return lead;
+
+    int length = end - offset;
+    unsigned long value = lead & (0x7F >> length);
+    for (size_t i = offset + 1; i < end; i++)
+        value = (value << 6) | (text[i] & 0x3F);
+    return value;
+}
+
+static _Bool extends_grapheme(unsigned long code_point) {
+    return (code_point >= 0x0300 && code_point <= 0x036F)
+        || (code_point >= 0x0483 && code_point <= 0x0489)
+        || (code_point >= 0x0591 && code_point <= 0x05C7)
+        || (code_point >= 0x0610 && code_point <= 0x061A)
+        || (code_point >= 0x064B && code_point <= 0x065F)
+        || (code_point >= 0x0900 && code_point <= 0x0903)
+        || (code_point >= 0x093A && code_point <= 0x094F)
+        || (code_point >= 0x1AB0 && code_point <= 0x1AFF)
+        || (code_point >= 0x1DC0 && code_point <= 0x1DFF)
+        || code_point == 0x200C || code_point == 0x200D
+        || (code_point >= 0x20D0 && code_point <= 0x20FF)
+        || (code_point >= 0xFE00 && code_point <= 0xFE0F)
+        || (code_point >= 0xFE20 && code_point <= 0xFE2F)
+        || (code_point >= 0x1F3FB && code_point <= 0x1F3FF)
+        || (code_point >= 0xE0020 && code_point <= 0xE007F)
+        || (code_point >= 0xE0100 && code_point <= 0xE01EF);
+}
+
+#define IS_REGIONAL_INDICATOR(code_point) \
+    ((code_point) >= 0x1F1E6 && (code_point) <= 0x1F1FF)
+
+// A cluster is a code point plus anything that extends it, anything joined
+// on after a ZWJ, and for a regional indicator, the second half of the flag.
+static size_t grapheme_end(const char *text, size_t offset, size_t length) {
+    size_t end = code_point_end(text, offset, length);
+    unsigned long previous = decode_code_point(text, offset, end);
+    _Bool open_flag = IS_REGIONAL_INDICATOR(previous);
+
+    while (end < length) {
+        size_t next_end = code_point_end(text, end, length);
+        unsigned long next = decode_code_point(text, end, next_end);
+
+        _Bool joins = extends_grapheme(next) || previous == 0x200D
+                      || (open_flag && IS_REGIONAL_INDICATOR(next));
+        if (!joins) break;
+
+        open_flag = 0;
+        previous = next;
+        end = next_end;
+    }
+    return end;
+}
+
+static size_t unit_end(enum reverse_text_mode mode, const char *text,
+                       size_t offset, size_t length) {
+    if (mode == REVERSE_GRAPHEMES) return grapheme_end(text, offset, length);
+    return code_point_end(text, offset, length);
+}
+
+// True if a run of ASCII ending just before offset can be treated as units
+// of one byte each, meaning nothing at offset attaches itself to the run's
+// last character.
+static _Bool ascii_run_ends_at(enum reverse_text_mode mode, const char *text,
+                               size_t offset, size_t length) {
+    if (offset == length) return 1;
+    if (IS_CONTINUATION(text[offset])) return 0;
+    if (mode != REVERSE_GRAPHEMES) return 1;
+
+    size_t end = code_point_end(text, offset, length);
+    return !extends_grapheme(decode_code_point(text, offset, end));
+}
+
+// Both directions walk the text forwards, so the units always come out the
+// same no matter which one a path uses. Runs of ASCII are skipped 32 bytes at
+// a time and handed to the byte kernels, so only the stretches around actual
+// multi-byte characters are looked at one unit at a time. The copy version
+// places each unit at the mirrored position in dst. The in-place version
+// reverses each multi-byte unit on its own first, so the byte reversal of the
+// whole text afterwards puts their bytes back the right way round.
+static void reverse_text_copy_utf8(enum reverse_text_mode mode, char *dst,
+                                   const char *src, size_t length) {
+    if (is_ascii(src, length)) {
+        reverse_copy(dst, src, length);
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        if (length - offset >= 32 && is_ascii_scalar(src + offset, 32)
+            && ascii_run_ends_at(mode, src, offset + 32, length)) {
+            reverse_copy(dst + length - offset - 32, src + offset, 32);
+            offset += 32;
+            continue;
+        }
+        size_t end = unit_end(mode, src, offset, length);
+        memcpy(dst + length - end, src + offset, end - offset);
+        offset = end;
+    }
+}
+
+static void reverse_text_in_place_utf8(enum reverse_text_mode mode,
+                                       char *buffer, size_t length) {
+    if (!is_ascii(buffer, length)) {
+        size_t offset = 0;
+        while (offset < length) {
+            if (length - offset >= 32 && is_ascii_scalar(buffer + offset, 32)
+                && ascii_run_ends_at(mode, buffer, offset + 32, length)) {
+                offset += 32;
+                continue;
+            }
+            size_t end = unit_end(mode, buffer, offset, length);
+            reverse_in_place_scalar(buffer + offset, end - offset);
+            offset = end;
+        }
+    }
+    reverse_in_place(buffer, length);
+}
+
+static void select_kernels(void) {
+#if defined(HAVE_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        reverse_copy = reverse_copy_avx2;
+        reverse_in_place = reverse_in_place_avx2;
+        find_line_ends = find_line_ends_avx2;
+        is_ascii = is_ascii_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        reverse_copy = reverse_copy_ssse3;
+        reverse_in_place = reverse_in_place_ssse3;
+        find_line_ends = find_line_ends_sse2;
+        is_ascii = is_ascii_sse2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_line_ends = find_line_ends_sse2;
+        is_ascii = is_ascii_sse2;
+    }
+#elif defined(HAVE_NEON_KERNELS)
+    reverse_copy = reverse_copy_neon;
+    reverse_in_place = reverse_in_place_neon;
+    find_line_ends = find_line_ends_neon;
+    is_ascii = is_ascii_neon;
+#endif
+}
+
+static _Bool splits_fields(const struct reverse_options *options) {
+    return options->field_range_count || options->reverse_field_order;
+}
+
+// The kernels are process-wide, so they're picked once no matter how many
+// contexts get set up, or from how many threads.
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+int reverse_init(struct reverse_context *ctx,
+                 const struct reverse_options *options) {
+    static const struct reverse_options defaults = REVERSE_OPTIONS_DEFAULT;
+    if (!options) options = &defaults;
+    if (options->text_mode != REVERSE_BYTES
+        && options->text_mode != REVERSE_CODE_POINTS
+        && options->text_mode != REVERSE_GRAPHEMES) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < options->field_range_count; i++) {
+        const struct reverse_field_range *range = &options->field_ranges[i];
+        if (!range->first || range->first > range->last) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (splits_fields(options)
+        && options->field_separator == options->delimiter) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_once(&kernels_selected, select_kernels);
+    memset(ctx, 0, sizeof *ctx);
+    ctx->options = *options;
+    return 0;
+}
+
+void reverse_bytes(char *dst, const char *src, size_t length) {
+    if (dst == src) {
+        reverse_in_place(dst, length);
+        return;
+    }
+    reverse_copy(dst, src, length);
+}
+
+// In byte mode this is just the kernels, so the default costs exactly what it
+// did before --utf8 existed.
+void reverse_text(const struct reverse_context *ctx, char *dst,
+                  const char *src, size_t length) {
+    enum reverse_text_mode mode = ctx->options.text_mode;
+    if (mode == REVERSE_BYTES) {
+        reverse_bytes(dst, src, length);
+    } else if (dst == src) {
+        reverse_text_in_place_utf8(mode, dst, length);
+    } else {
+        reverse_text_copy_utf8(mode, dst, src, length);
+    }
+}
+
+size_t reverse_terminator_length(const struct reverse_context *ctx,
+                                 const char *record, size_t length) {
+    if (!length || record[length - 1] != ctx->options.delimiter) return 0;
+    if (ctx->options.keep_crlf && length >= 2 && record[length - 2] == '\r')
+        return 2;
+    return 1;
+}
+
+// Fields are found with the same kernels as records, a batch of separators
+// at a time.
+#define FIELD_BATCH_SIZE 256
+
+static _Bool field_selected(const struct reverse_options *options,
+                            size_t field) {
+    for (size_t i = 0; i < options->field_range_count; i++) {
+        if (field >= options->field_ranges[i].first
+            && field <= options->field_ranges[i].last)
+            return 1;
+    }
+    return 0;
+}
+
+static size_t count_fields(char separator, const char *text, size_t length) {
+    size_t ends[FIELD_BATCH_SIZE];
+    size_t fields = 1, start = 0, count;
+    do {
+        count = find_line_ends(text + start, length - start, separator, ends,
+                               FIELD_BATCH_SIZE);
+        fields += count;
+        if (count) start += ends[count - 1];
+    } while (count == FIELD_BATCH_SIZE);
+    return fields;
+}
+
+// field is counted in the order the fields are in now, last_field is how
+// many there are.
+static void reverse_field(const struct reverse_context *ctx, char *text,
+                          size_t length, size_t field, size_t last_field) {
+    if (ctx->options.reverse_field_order) {
+        field = last_field + 1 - field;
+        reverse_bytes(text, text, length);
+    }
+    if (field_selected(&ctx->options, field))
+        reverse_text(ctx, text, text, length);
+}
+
+// Mirroring the whole record puts the fields in the opposite order, each of
+// them back to front, so every field is then turned around again, and the
+// chosen ones reversed in the text mode from there. Byte reversal undoes
+// itself exactly, so the fields that stay put come out intact in the UTF-8
+// modes too.
+static void reverse_fields(const struct reverse_context *ctx, char *dst,
+                           const char *src, size_t length) {
+    char separator = ctx->options.field_separator;
+    size_t last_field = 0;
+    if (ctx->options.reverse_field_order) {
+        last_field = count_fields(separator, src, length);
+        reverse_bytes(dst, src, length);
+    } else if (dst != src) {
+        memcpy(dst, src, length);
+    }
+
+    size_t ends[FIELD_BATCH_SIZE];
+    size_t start = 0, field = 0, count;
+    do {
+        size_t base = start;
+        count = find_line_ends(dst + base, length - base, separator, ends,
+                               FIELD_BATCH_SIZE);
+        for (size_t i = 0; i < count; i++) {
+            size_t end = base + ends[i];
+            reverse_field(ctx, dst + start, end - 1 - start, ++field,
+                          last_field);
+            start = end;
+        }
+    } while (count == FIELD_BATCH_SIZE);
+    reverse_field(ctx, dst + start, length - start, ++field, last_field);
+}
+
+void reverse_record(const struct reverse_context *ctx, char *dst,
+                    const char *src, size_t length) {
+    size_t kept = reverse_terminator_length(ctx, src, length);
+    if (splits_fields(&ctx->options))
+        reverse_fields(ctx, dst, src, length - kept);
+    else
+        reverse_text(ctx, dst, src, length - kept);
+    if (dst != src) memcpy(dst + length - kept, src + length - kept, kept);
+}
+
+size_t reverse_find_record_ends(const struct reverse_context *ctx,
+                                const char *block, size_t length,
+                                size_t *ends, size_t max_ends) {
+    return find_line_ends(block, length, ctx->options.delimiter, ends,
+                          max_ends);
+}
+
+// Only the code points either side of a candidate are looked at, so this can
+// be asked about any stretch of a record without scanning it from the start.
+// A boundary seen that way is a boundary to the forward scan as well: nothing
+// joins a code point that doesn't extend and doesn't follow a ZWJ, unless
+// both are regional indicators, and then it takes counting back to the start
+// of the run to know whether they pair up.
+size_t reverse_unit_boundary(const struct reverse_context *ctx,
+                             const char *text, size_t length, size_t offset) {
+    enum reverse_text_mode mode = ctx->options.text_mode;
+    if (mode == REVERSE_BYTES) return offset;
+
+    for (size_t at = offset ? offset : 1; at < length; at++) {
+        if (IS_CONTINUATION(text[at])) continue;
+        if (mode == REVERSE_CODE_POINTS) return at;
+
+        size_t before = at - 1;
+        while (before && IS_CONTINUATION(text[before]) && at - before < 4)
+            before--;
+        if (IS_CONTINUATION(text[before])) continue;
+
+        unsigned long previous = decode_code_point(text, before, at);
+        unsigned long next = decode_code_point(text, at,
+                                               code_point_end(text, at,
+                                                              length));
+        if (!extends_grapheme(next) && previous != 0x200D
+            && !(IS_REGIONAL_INDICATOR(previous)
+                 && IS_REGIONAL_INDICATOR(next)))
+            return at;
+    }
+    return length;
+}
+
+// In byte mode, with no fields, the batch is one tight loop around the kernel,
+// which is picked once for the whole batch instead of once per record.
+void reverse_record_batch(const struct reverse_context *ctx, char *dst,
+                          const char *src, size_t first, const size_t *ends,
+                          size_t count) {
+    size_t start = first;
+    if (ctx->options.text_mode != REVERSE_BYTES
+        || splits_fields(&ctx->options)) {
+        for (size_t i = 0; i < count; i++) {
+            reverse_record(ctx, dst + start - first, src + start,
+                           ends[i] - start);
+            start = ends[i];
+        }
+        return;
+    }
+
+    _Bool in_place = dst == src + first;
+    for (size_t i = 0; i < count; i++) {
+        size_t end = ends[i];
+        size_t kept = reverse_terminator_length(ctx, src + start, end - start);
+        char *out = dst + start - first;
+        if (in_place) {
+            reverse_in_place(out, end - start - kept);
+        } else {
+            reverse_copy(out, src + start, end - start - kept);
+            if (kept) out[end - start - 1] = src[end - 1];
+            if (kept == 2) out[end - start - 2] = src[end - 2];
+        }
+        start = end;
+    }
+}
+
+// The batch of record ends lives on the stack, so any number of threads can
+// be in here at once with the same context.
+#define RECORD_BATCH_SIZE 4096
+
+void reverse_records(const struct reverse_context *ctx, char *dst,
+                     const char *src, size_t length) {
+    size_t ends[RECORD_BATCH_SIZE];
+    size_t start = 0;
+    while (start < length) {
+        size_t count = reverse_find_record_ends(ctx, src + start,
+                                                length - start, ends,
+                                                RECORD_BATCH_SIZE);
+        if (!count) ends[count++] = length - start;
+
+        reverse_record_batch(ctx, dst + start, src + start, 0, ends, count);
+        start += ends[count - 1];
+    }
+}
+
+// Records are found from the back with memrchr(), which glibc vectorizes as
+// well as the forward scanners here are.
+void reverse_record_order(const struct reverse_context *ctx, char *dst,
+                          const char *src, size_t length,
+                          _Bool each_reversed) {
+    size_t end = length;
+    while (end) {
+        const char *found = memrchr(src, ctx->options.delimiter, end - 1);
+        size_t start = found ? (size_t)(found - src) + 1 : 0;
+        char *out = dst + length - end;
+        if (each_reversed)
+            reverse_record(ctx, out, src + start, end - start);
+        else
+            memcpy(out, src + start, end - start);
+        end = start;
+    }
+}
+
+// The streaming side is a small state machine with one piece of state: the
+// start of a record that an earlier push didn't finish, held in the caller's
+// spill buffer. Records that start and end within one push are reversed right
+// where they are in data and emitted from there, so they're never copied.
+//
+// In byte mode the held part is kept already reversed, packed against the end
+// of the spill, and every later piece of the same record is reversed in front
+// of it. The reverse of A + B is the reverse of B followed by the reverse of
+// A, so when the record's end finally arrives, it's reversed in place in data
+// and emitted, followed by the spill as it stands. Characters can't be cut in
+// half like that, and fields can't be told apart until the record is whole, so
+// in the UTF-8 modes and with fields, the spill holds the raw bytes, the end
+// is appended, and the whole record is reversed inside the spill.
+//
+// A push that would overflow the spill fails with ENOBUFS before it has
+// emitted anything or changed any state, so the caller can hand over a bigger
+// spill and push the same data again.
+static _Bool spills_reversed(const struct reverse_context *ctx) {
+    return ctx->options.text_mode == REVERSE_BYTES
+           && !splits_fields(&ctx->options);
+}
+
+static char *spill_start(const struct reverse_context *ctx) {
+    if (spills_reversed(ctx))
+        return ctx->spill + ctx->spill_size - ctx->spill_length;
+    return ctx->spill;
+}
+
+int reverse_set_spill(struct reverse_context *ctx, char *spill, size_t size) {
+    if (ctx->spill_length > size) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (ctx->spill_length) {
+        char *moved = spill;
+        if (spills_reversed(ctx)) moved = spill + size - ctx->spill_length;
+        memmove(moved, spill_start(ctx), ctx->spill_length);
+    }
+    ctx->spill = spill;
+    ctx->spill_size = size;
+    return 0;
+}
+
+static void spill_unfinished(struct reverse_context *ctx, const char *data,
+                             size_t length) {
+    if (!length) return;
+    if (spills_reversed(ctx)) {
+        ctx->spill_length += length;
+        reverse_bytes(spill_start(ctx), data, length);
+        return;
+    }
+    memcpy(ctx->spill + ctx->spill_length, data, length);
+    ctx->spill_length += length;
+}
+
+static int emit_piece(reverse_emit_fn emit, void *user, const char *data,
+                      size_t length) {
+    return length ? emit(user, data, length) : 0;
+}
+
+// Completes the held record with head, the start of a push up to and
+// including its first delimiter. In byte mode with keep_crlf, a head that's
+// nothing but the delimiter can still be the end of a CRLF, with the '\r' as
+// the held part's last byte, which is the first byte of the spill.
+static int finish_spilled(struct reverse_context *ctx, char *head,
+                          size_t length, reverse_emit_fn emit, void *user) {
+    char *held = spill_start(ctx);
+    size_t held_length = ctx->spill_length;
+    ctx->spill_length = 0;
+
+    if (!spills_reversed(ctx)) {
+        memcpy(held + held_length, head, length);
+        reverse_record(ctx, held, held, held_length + length);
+        return emit(user, held, held_length + length);
+    }
+
+    if (length == 1 && ctx->options.keep_crlf && held[0] == '\r') {
+        char terminator[2] = { '\r', head[0] };
+        int status = emit_piece(emit, user, held + 1, held_length - 1);
+        return status ? status : emit(user, terminator, 2);
+    }
+
+    size_t kept = reverse_terminator_length(ctx, head, length);
+    reverse_bytes(head, head, length - kept);
+
+    int status = emit_piece(emit, user, head, length - kept);
+    if (!status) status = emit(user, held, held_length);
+    if (!status) status = emit(user, head + length - kept, kept);
+    return status;
+}
+
+int reverse_push(struct reverse_context *ctx, char *data, size_t length,
+                 reverse_emit_fn emit, void *user) {
+    char delimiter = ctx->options.delimiter;
+    char *first = memchr(data, delimiter, length);
+    char *last = first ? memrchr(first, delimiter, data + length - first)
+                       : NULL;
+    size_t head = first ? (size_t)(first - data) + 1 : 0;
+    size_t whole = last ? (size_t)(last - data) + 1 : 0;
+
+    _Bool fits = ctx->spill_length + length <= ctx->spill_size;
+    if (first) {
+        fits = length - whole <= ctx->spill_size;
+        if (ctx->spill_length && !spills_reversed(ctx))
+            fits = fits && ctx->spill_length + head <= ctx->spill_size;
+    }
+    if (!fits) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size_t start = 0;
+    if (first && ctx->spill_length) {
+        int status = finish_spilled(ctx, data, head, emit, user);
+        if (status) return status;
+        start = head;
+    }
+    if (whole > start) {
+        reverse_records(ctx, data + start, data + start, whole - start);
+        int status = emit(user, data + start, whole - start);
+        if (status) return status;
+    }
+
+    spill_unfinished(ctx, data + whole, length - whole);
+    return 0;
+}
+
+// Whatever is still held when the stream ends is a last record without a
+// delimiter, which is reversed whole. In byte mode the spill already holds it
+// that way. Since it has no terminator, reversing it as a record only makes a
+// difference with fields.
+int reverse_finish(struct reverse_context *ctx, reverse_emit_fn emit,
+                   void *user) {
+    char *held = spill_start(ctx);
+    size_t length = ctx->spill_length;
+    ctx->spill_length = 0;
+    if (!length) return 0;
+
+    if (!spills_reversed(ctx)) reverse_record(ctx, held, held, length);
+    return emit(user, held, length);
+}
+
+size_t reverse_drain_spill(struct reverse_context *ctx, char **data) {
+    size_t length = ctx->spill_length;
+    *data = spill_start(ctx);
+    if (length && spills_reversed(ctx))
+        reverse_bytes(*data, *data, length);
+    ctx->spill_length = 0;
+    return length;
+}
+
+int reverse_pump(struct reverse_context *ctx, char *buffer, size_t size,
+                 reverse_read_fn source, void *source_user,
+                 reverse_emit_fn emit, void *emit_user) {
+    for (;;) {
+        ssize_t got = source(source_user, buffer, size);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) return reverse_finish(ctx, emit, emit_user);
+
+        int status = reverse_push(ctx, buffer, got, emit, emit_user);
+        if (status) return status;
+    }
+}
+
+/* Build with reverse.c, or on its own as a static library:
+ *
+ *   cc -O2 -c libreverse.c && ar rcs libreverse.a libreverse.o
+ *
+ * and link with -pthread for the pthread_once() in reverse_init().
+ */
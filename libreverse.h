@@ -0,0 +1,185 @@
+/* libreverse - the line reverser from reverse.c, without the program around it
+ *
+ * Everything reverse.c does to a record lives behind this header, so a
+ * service can reverse its own buffers without a fork/exec per file. There are
+ * two ways in:
+ *
+ *  - The buffer functions work on whole records the caller already has in
+ *    memory, either into a second buffer of the same length or in place.
+ *    They only read the context, so one context can be shared between as
+ *    many threads as you like.
+ *
+ *  - The streaming functions take the input in whatever pieces it arrives in,
+ *    from a file, a pipe or a socket, and hand back reversed output through
+ *    a callback. A record cut in two by the end of a piece waits in a spill
+ *    buffer for the next call, so the pieces don't have to line up with
+ *    anything. The spill is state, so every stream needs a context of its
+ *    own.
+ *
+ * Nothing in here prints, exits or allocates; every buffer belongs to the
+ * caller. Functions that can fail return 0 on success and -1 with errno set
+ * otherwise, except that an error returned by the caller's emit callback is
+ * passed straight back up.
+ */
+
+#ifndef LIBREVERSE_H
+#define LIBREVERSE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// What gets reversed within a record: bytes, UTF-8 code points, or
+// (approximate) grapheme clusters. See --utf8 in reverse.c.
+enum reverse_text_mode {
+    REVERSE_BYTES,
+    REVERSE_CODE_POINTS,
+    REVERSE_GRAPHEMES
+};
+
+// A run of fields, counted from 1. last is SIZE_MAX for the rest of them.
+struct reverse_field_range {
+    size_t first;
+    size_t last;
+};
+
+// Records end with delimiter. With keep_crlf, a '\r' just before the
+// delimiter counts as part of the terminator and stays at the end.
+//
+// Giving field ranges, or reverse_field_order, splits each record into fields
+// on field_separator. Then only the fields in the ranges (numbered as they
+// come in) are reversed, and with reverse_field_order the fields come out
+// last to first, separators and all. The ranges belong to the caller and have
+// to outlive the context.
+struct reverse_options {
+    char delimiter;
+    _Bool keep_crlf;
+    enum reverse_text_mode text_mode;
+
+    char field_separator;
+    _Bool reverse_field_order;
+    const struct reverse_field_range *field_ranges;
+    size_t field_range_count;
+};
+
+#define REVERSE_OPTIONS_DEFAULT { '\n', 0, REVERSE_BYTES, '\t', 0, NULL, 0 }
+
+// Treat the fields as private; they're only here so a context can live on the
+// stack or inside the caller's own structs. spill_length bytes of spill hold
+// the start of a record whose end hasn't been pushed yet.
+struct reverse_context {
+    struct reverse_options options;
+
+    char *spill;
+    size_t spill_size;
+    size_t spill_length;
+};
+
+// Called with each piece of reversed output, in order. The data is only valid
+// until the callback returns. Anything but 0 stops the stream, and that value
+// is returned from reverse_push() or reverse_finish(); the stream can't be
+// carried on with after that.
+typedef int (*reverse_emit_fn)(void *user, const char *data, size_t length);
+
+// Where reverse_pump() gets its input. Returns like read(2): the number of
+// bytes put in buffer, 0 at the end of the input, or -1 with errno set.
+typedef ssize_t (*reverse_read_fn)(void *user, char *buffer, size_t size);
+
+// Sets up ctx with a copy of options, or the defaults when options is NULL,
+// and picks the fastest kernels this CPU supports. Fails with EINVAL on an
+// unknown text mode, a field range that's empty or starts at 0, or a field
+// separator that's also the delimiter.
+int reverse_init(struct reverse_context *ctx,
+                 const struct reverse_options *options);
+
+// Reverses length bytes from src into dst. Passing the same pointer for both
+// reverses in place; otherwise the two must not overlap.
+void reverse_bytes(char *dst, const char *src, size_t length);
+
+// The same, but in units of ctx's text mode. Malformed UTF-8 still comes out
+// the same length it went in.
+void reverse_text(const struct reverse_context *ctx, char *dst,
+                  const char *src, size_t length);
+
+// How many bytes at the end of record are its terminator: 0, 1, or 2 for a
+// CRLF with keep_crlf.
+size_t reverse_terminator_length(const struct reverse_context *ctx,
+                                 const char *record, size_t length);
+
+// Reverses one record, leaving its terminator at the end. With fields, that
+// means the chosen fields and/or their order, and the record must be whole.
+void reverse_record(const struct reverse_context *ctx, char *dst,
+                    const char *src, size_t length);
+
+// The batch step the rest is built on, for a caller that has already found
+// its records. The first runs from offset first in src to ends[0], and each
+// of the others from the end of the one before to its own entry in ends,
+// which is how reverse_find_record_ends() hands them back. dst gets the count
+// records back to back from its start, ends[count - 1] - first bytes of them;
+// src + first reverses them in place.
+void reverse_record_batch(const struct reverse_context *ctx, char *dst,
+                          const char *src, size_t first, const size_t *ends,
+                          size_t count);
+
+// Reverses every record in src. A last record without a terminator is
+// reversed whole. dst is the same length as src, or src itself.
+void reverse_records(const struct reverse_context *ctx, char *dst,
+                     const char *src, size_t length);
+
+// Puts the records in src into dst last to first, like tac(1), and with
+// each_reversed reverses every one of them the way reverse_record() does as
+// well. A last record without a terminator comes out first, still without
+// one. dst is the same length as src, and they must not overlap.
+void reverse_record_order(const struct reverse_context *ctx, char *dst,
+                          const char *src, size_t length,
+                          _Bool each_reversed);
+
+// Records the offset just past each of the first max_ends delimiters in
+// block, and returns how many it found.
+size_t reverse_find_record_ends(const struct reverse_context *ctx,
+                                const char *block, size_t length,
+                                size_t *ends, size_t max_ends);
+
+// The first offset at or after offset (and past the first byte) where a unit
+// of ctx's text mode is certain to start, or length if there's none. Reversing
+// a record in pieces cut there gives the same result as reversing it whole,
+// so a long record can be done a buffer at a time from its end. In byte mode
+// every offset qualifies. None of this holds once records are split into
+// fields.
+size_t reverse_unit_boundary(const struct reverse_context *ctx,
+                             const char *text, size_t length, size_t offset);
+
+// Gives a stream the buffer that an unfinished record waits in. It has to be
+// able to hold the longest record the stream will see, short of its last
+// piece. Anything already held is moved over, so a stream can be switched to
+// a bigger spill halfway through; the old one is free again afterwards.
+// Fails with ENOBUFS, and keeps the old spill, if the held bytes don't fit.
+int reverse_set_spill(struct reverse_context *ctx, char *spill, size_t size);
+
+// Hands back the unfinished record the spill is holding, in its original
+// byte order, and forgets it, for a caller that wants to put a record that's
+// grown too long somewhere else. *data points into the spill, so it's only
+// good until the next push.
+size_t reverse_drain_spill(struct reverse_context *ctx, char **data);
+
+// Feeds the next piece of a stream. Every record this piece completes is
+// reversed and emitted before it returns, mostly straight out of data, which
+// is overwritten along the way. The unfinished tail goes to the spill. If it
+// won't fit, the push fails with ENOBUFS without having emitted or changed
+// anything, so it can be repeated once reverse_set_spill() has made room.
+int reverse_push(struct reverse_context *ctx, char *data, size_t length,
+                 reverse_emit_fn emit, void *user);
+
+// Ends the stream, emitting the carried-over last record if it didn't end
+// with a delimiter. ctx is ready for a new stream afterwards.
+int reverse_finish(struct reverse_context *ctx, reverse_emit_fn emit,
+                   void *user);
+
+// The pull side: reads from source into buffer until the end of the input,
+// pushing each piece, then finishes the stream. For a socket, source can just
+// call recv(). A record that outgrows the spill ends it with ENOBUFS; callers
+// that would rather grow the spill can run the loop themselves.
+int reverse_pump(struct reverse_context *ctx, char *buffer, size_t size,
+                 reverse_read_fn source, void *source_user,
+                 reverse_emit_fn emit, void *emit_user);
+
+#endif
@@ -42,123 +42,4588 @@
  * and go up.
  */
 
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#define HAVE_MEMPOLICY 1
+#endif
+#endif
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if __has_include(<stdio_ext.h>)
+#include <stdio_ext.h>
+#define HAVE_STDIO_EXT 1
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "libreverse.h"
+
+FILE *input_file = NULL;
+FILE *output_file = NULL;
+
+// The mmap path maps the whole input at once and walks its lines through
+// input_region, with a cursor for how far we've got. Rather than one line at
+// a time, a whole batch of line boundaries is found at once: line_ends holds
+// the offset just past each line in the current batch, relative to the start
+// of the region. Lines are never copied anywhere before they're reversed.
+//
+// Everything that can't be mapped goes the block path: the input is read a
+// big piece at a time into input_block and pushed through libreverse's
+// streaming stage. A line cut off by the end of a block waits in input_spill
+// until later blocks finish it.
+#define LINE_BATCH_SIZE 4096
+#define DEFAULT_INPUT_BLOCK_SIZE (1 << 20)
+
+char *input_map = NULL;
+size_t input_map_size = 0;
+
+char *input_block = NULL;
+size_t input_block_size = 0;
+char *input_spill = NULL;
+size_t input_spill_size = 0;
+
+char *input_region = NULL;
+size_t input_region_size = 0;
+size_t input_region_offset = 0;
+
+size_t line_ends[LINE_BATCH_SIZE];
+size_t line_count = 0;
+
+// Records end with options.delimiter, which -d can change to anything,
+// including NUL for find -print0 output. The rest of the code still calls
+// them lines. With --crlf, a '\r' just before the delimiter is treated as part
+// of the terminator and stays at the end instead of being reversed to the
+// front. The reversing itself is done by libreverse, through the one context
+// that main() sets up from these options; see libreverse.h.
+struct reverse_options options = REVERSE_OPTIONS_DEFAULT;
+struct reverse_context reverser;
+
+// -f picks fields to reverse, in a list like cut(1) takes, and
+// --reverse-field-order turns the fields around. Either one splits every line
+// on options.field_separator, a tab unless -t says otherwise. The ranges live
+// here, and options points at them.
+struct reverse_field_range *field_ranges = NULL;
+size_t field_range_count = 0;
+
+_Bool splitting_fields(void) {
+    return options.field_range_count || options.reverse_field_order;
+}
+
+// --tac puts the lines in the opposite order instead, like tac(1), and
+// --tac=reversed reverses each of them as well.
+_Bool tac_mode = 0;
+_Bool tac_reverse_lines = 0;
+
+// Everything headed for output_file is collected here first and handed to the
+// kernel a chunk at a time. The size can be changed with -b; a few megabytes
+// is enough to make the per-write overhead disappear.
+#define DEFAULT_OUTPUT_BUFFER_SIZE (4 << 20)
+
+char *output_buffer = NULL;
+size_t output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+size_t output_buffer_capacity = 0;
+size_t output_buffer_used = 0;
+
+// When output_file is a pipe on Linux, full output buffers are handed to the
+// pipe with vmsplice instead of being copied in with write. The pipe then
+// refers to our pages directly, so they can't be touched again until the
+// reader has consumed them. output_buffer is sized to exactly the pipe's
+// capacity and always spliced whole, and there's a spare buffer to fill in
+// the meantime. Once the spare has been spliced in full, the pipe holds
+// nothing but the spare's pages, which proves the reader is done with the
+// first one.
+_Bool splice_output = 0;
+char *output_spare = NULL;
+
+// --direct turns on O_DIRECT for the I/O that already comes in aligned, whole
+// buffers: the single writer's full output buffers on a regular file, and the
+// io_uring backend's reads. None of it goes through the page cache then,
+// which is more about leaving the cache to everyone else than about speed. A
+// last short buffer can't go that way, so O_DIRECT comes off again for it.
+_Bool use_direct_io = 0;
+_Bool direct_output = 0;
+_Bool direct_input = 0;
+
+// -j splits a mapped input into chunks of about chunk_size bytes, each
+// stretched to end on a newline, and hands them to a pool of worker threads.
+// A chunk plays the same role for a worker as output_buffer does for the
+// single-threaded loop, so -b sets both.
+#define DEFAULT_CHUNK_SIZE (4 << 20)
+#define MAX_THREADS 1024
+#define MAX_NODES 64
+
+long thread_count = 1;
+size_t chunk_size = DEFAULT_CHUNK_SIZE;
+_Bool use_pwrite = 0;
+
+// --in-place maps the one file named on the command line read-write and
+// reverses every line right there in the page cache. Lines keep their length,
+// so nothing ever needs to move and no second copy of the file is made.
+_Bool in_place = 0;
+_Bool workers_running = 0;
+
+// --io-uring asks for the asynchronous backend. It only applies when both
+// files are regular files and the kernel lets us set up a ring; otherwise the
+// usual paths run as if it hadn't been given.
+_Bool use_io_uring = 0;
+
+// Input and output can each be compressed; see compress_output() and
+// inflate_input().
+enum compression { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+
+enum compression input_compression = COMPRESSION_NONE;
+enum compression output_compression = COMPRESSION_NONE;
+
+// cleanup() lives further down with the rest of main()'s helpers, but the
+// lower-level functions need to be able to bail out too, so it's declared up
+// here along with the exit macros that use it. A successful exit also gets
+// to finish off a compressed output first.
+void finish_output(void);
+void cleanup(void);
+
+#define EXIT_ERR cleanup(); exit(1);
+#define EXIT_SUCC finish_output(); cleanup(); exit(0);
+
+// --stats keeps count of what each stage does and prints it all to stderr on
+// the way out, as text or, with --stats=json, as one JSON object. The stages
+// are reading, reversing and writing. Reads and writes are counted a system
+// call at a time. Reversing is counted a batch at a time: a batch of lines on
+// the mmap path, a block on the block path, a chunk with -j. The single
+// threaded loops write as they go, so time spent writing in the middle of a
+// batch is taken back out of the batch's. A mapped input has no reads to
+// count; its pages are faulted in while it's reversed, and that's where the
+// time shows up. With -j the reversing time is added up over the workers,
+// so it can come to more than the run took. io_uring reads and writes
+// overlap everything else, so they're counted but not timed.
+//
+// Counting is a relaxed atomic add, which is nothing next to a batch, but
+// reading the clock twice per call isn't, and neither is the extra scan that
+// finds a batch's lines. --stats-sample N only does those for one call in N
+// of each stage and scales up from there, which brings the cost down to
+// noise. The line count is then an estimate, and the longest line is the
+// longest one that was seen.
+enum stats_stage { STATS_READ, STATS_REVERSE, STATS_WRITE, STATS_STAGES };
+
+const char *stats_stage_names[STATS_STAGES] = { "read", "reverse", "write" };
+
+struct stage_stats {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t timed_calls;
+    uint64_t nanoseconds;
+};
+
+#define STATS_LINE_BATCH 1024
+
+_Bool collect_stats = 0;
+_Bool stats_json = 0;
+uint64_t stats_sample = 1;
+struct timespec stats_started;
+
+struct stage_stats stage_stats[STATS_STAGES];
+uint64_t stats_lines = 0;
+uint64_t stats_counted_bytes = 0;
+uint64_t stats_longest_line = 0;
+uint64_t stats_buffers_taken = 0;
+uint64_t stats_buffers_mapped = 0;
+uint64_t stats_other_syscalls = 0;
+
+// With --affinity=nodes the reversing is added up per node as well, so
+// it's plain to see when one node's workers are slower than another's.
+struct node_stats {
+    int id;
+    uint64_t workers;
+    uint64_t bytes;
+    uint64_t timed_bytes;
+    uint64_t nanoseconds;
+};
+
+struct node_stats node_stats[MAX_NODES];
+int stats_node_count = 0;
+_Thread_local int stats_node = -1;
+
+// With -j every worker has batches of its own, so what's nested in which
+// batch, and how long the line running off the end of the last one was, are
+// kept per thread. A run that started in a batch nobody counted is unknown.
+_Thread_local _Bool stats_in_timed_batch = 0;
+_Thread_local uint64_t stats_nested_nanoseconds = 0;
+_Thread_local uint64_t stats_line_run = 0;
+_Thread_local _Bool stats_run_known = 1;
+
+void stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void stats_max(uint64_t *counter, uint64_t value) {
+    uint64_t seen = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > seen
+           && !__atomic_compare_exchange_n(counter, &seen, value, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Counts a call to stage, and returns when it started, or 0 if this one isn't
+// being timed. Calls inside a timed batch are always timed, so that the
+// batch's own time comes out right.
+uint64_t stats_begin(enum stats_stage stage) {
+    if (!collect_stats) return 0;
+    uint64_t call = __atomic_fetch_add(&stage_stats[stage].calls, 1,
+                                       __ATOMIC_RELAXED);
+    if (call % stats_sample && !stats_in_timed_batch) return 0;
+    return stats_clock();
+}
+
+void stats_end(enum stats_stage stage, uint64_t started, size_t bytes) {
+    if (!collect_stats) return;
+    stats_add(&stage_stats[stage].bytes, bytes);
+    if (!started) return;
+
+    uint64_t elapsed = stats_clock() - started;
+    stats_add(&stage_stats[stage].timed_calls, 1);
+    stats_add(&stage_stats[stage].nanoseconds, elapsed);
+    if (stats_in_timed_batch) stats_nested_nanoseconds += elapsed;
+}
+
+// For I/O that's only counted, like io_uring's.
+void stats_count(enum stats_stage stage, size_t bytes) {
+    if (!collect_stats) return;
+    stats_add(&stage_stats[stage].calls, 1);
+    stats_add(&stage_stats[stage].bytes, bytes);
+}
+
+// Lines are found with the same vector scanner the mmap path uses. A batch
+// that continues the one before (block by block) can start partway through a
+// line; one that doesn't (a chunk, or a batch of whole lines) also ends on a
+// line's end, or the input's.
+void stats_count_lines(const char *data, size_t length, _Bool continues) {
+    size_t ends[STATS_LINE_BATCH];
+    uint64_t run = continues ? stats_line_run : 0;
+    _Bool known = !continues || stats_run_known;
+    uint64_t lines = 0, longest = 0;
+
+    size_t line_start = 0;
+    while (line_start < length) {
+        size_t count = reverse_find_record_ends(&reverser, data + line_start,
+                                                length - line_start, ends,
+                                                STATS_LINE_BATCH);
+        if (!count) break;
+
+        size_t base = line_start;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t line = base + ends[i] - line_start;
+            if (!line_start) line += run;
+            if ((known || line_start) && line > longest) longest = line;
+            lines++;
+            line_start = base + ends[i];
+        }
+    }
+
+    run = (line_start ? 0 : run) + length - line_start;
+    known = known || line_start;
+    if (!continues && run) {
+        lines++;
+        if (run > longest) longest = run;
+        run = 0;
+    }
+    stats_line_run = run;
+    stats_run_known = known;
+
+    stats_add(&stats_lines, lines);
+    stats_add(&stats_counted_bytes, length);
+    stats_max(&stats_longest_line, longest);
+}
+
+// The block path's last line has no delimiter, so nothing else would count it.
+void stats_finish_lines(void) {
+    if (!collect_stats || !stats_line_run) return;
+    stats_add(&stats_lines, 1);
+    if (stats_run_known) stats_max(&stats_longest_line, stats_line_run);
+    stats_line_run = 0;
+}
+
+// The reversing stage's stats_begin(). When the batch is sampled its lines are
+// counted too, before the clock starts so that counting isn't charged to
+// reversing.
+uint64_t stats_begin_batch(const char *data, size_t length, _Bool continues) {
+    uint64_t started = stats_begin(STATS_REVERSE);
+    if (!started) {
+        if (collect_stats) stats_run_known = 0;
+        return 0;
+    }
+
+    stats_count_lines(data, length, continues);
+    stats_in_timed_batch = 1;
+    stats_nested_nanoseconds = 0;
+    return stats_clock();
+}
+
+void stats_end_batch(uint64_t started, size_t length) {
+    if (!collect_stats) return;
+    stats_add(&stage_stats[STATS_REVERSE].bytes, length);
+    if (stats_node >= 0) stats_add(&node_stats[stats_node].bytes, length);
+    if (!started) return;
+
+    stats_in_timed_batch = 0;
+    uint64_t elapsed = stats_clock() - started - stats_nested_nanoseconds;
+    stats_add(&stage_stats[STATS_REVERSE].timed_calls, 1);
+    stats_add(&stage_stats[STATS_REVERSE].nanoseconds, elapsed);
+    if (stats_node >= 0) {
+        stats_add(&node_stats[stats_node].timed_bytes, length);
+        stats_add(&node_stats[stats_node].nanoseconds, elapsed);
+    }
+}
+
+// The big buffers all come from here rather than from malloc. They're mapped
+// directly, so they always start on a page boundary, and with --huge-pages
+// they're made of 2 MB pages: hugetlbfs pages if the system has any reserved,
+// otherwise transparent huge pages asked for with madvise(). A buffer that's
+// given back goes into a small pool, and the next request it's big enough for
+// gets it again, so the stages recycle each other's buffers rather than
+// allocating and freeing as line lengths change. The worker threads share
+// the pool, hence the lock.
+#define BUFFER_ALIGNMENT 4096
+#define HUGE_PAGE_SIZE (2 << 20)
+#define POOL_CAPACITY 16
+
+_Bool use_huge_pages = 0;
+
+struct pooled_buffer {
+    char *data;
+    size_t size;
+};
+
+struct pooled_buffer buffer_pool[POOL_CAPACITY];
+size_t pooled_count = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Trims an oversized mapping down to the 2 MB aligned stretch inside it, so
+// the kernel can back it with huge pages from the first byte.
+char *map_buffer(size_t size) {
+    int protection = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (!use_huge_pages) {
+        void *map = mmap(NULL, size, protection, flags, -1, 0);
+        return map == MAP_FAILED ? NULL : map;
+    }
+
+#ifdef MAP_HUGETLB
+    void *huge = mmap(NULL, size, protection, flags | MAP_HUGETLB, -1, 0);
+    if (huge != MAP_FAILED) return huge;
+#endif
+
+    char *map = mmap(NULL, size + HUGE_PAGE_SIZE, protection, flags, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    uintptr_t address = ((uintptr_t)map + HUGE_PAGE_SIZE - 1)
+                        & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    char *aligned = (char *)address;
+    if (aligned > map) munmap(map, aligned - map);
+    if (aligned < map + HUGE_PAGE_SIZE)
+        munmap(aligned + size, map + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+// Hands out the smallest pooled buffer that holds size bytes, or maps a new
+// one. *capacity is set to what the buffer really holds, which is what it
+// has to be given back with.
+char *take_buffer(size_t size, size_t *capacity) {
+    size_t granule = use_huge_pages ? HUGE_PAGE_SIZE : BUFFER_ALIGNMENT;
+    size = size ? (size + granule - 1) / granule * granule : granule;
+
+    pthread_mutex_lock(&pool_lock);
+    size_t best = pooled_count;
+    for (size_t i = 0; i < pooled_count; i++) {
+        if (buffer_pool[i].size < size) continue;
+        if (best == pooled_count || buffer_pool[i].size < buffer_pool[best].size)
+            best = i;
+    }
+    stats_add(&stats_buffers_taken, 1);
+    if (best < pooled_count) {
+        char *data = buffer_pool[best].data;
+        *capacity = buffer_pool[best].size;
+        buffer_pool[best] = buffer_pool[--pooled_count];
+        pthread_mutex_unlock(&pool_lock);
+        return data;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    stats_add(&stats_buffers_mapped, 1);
+    char *data = map_buffer(size);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        EXIT_ERR;
+    }
+    *capacity = size;
+    return data;
+}
+
+void give_buffer(char *data, size_t capacity) {
+    if (!data) return;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pooled_count < POOL_CAPACITY) {
+        buffer_pool[pooled_count].data = data;
+        buffer_pool[pooled_count].size = capacity;
+        pooled_count++;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (data) munmap(data, capacity);
+}
+
+void release_buffer_pool(void) {
+    for (size_t i = 0; i < pooled_count; i++)
+        munmap(buffer_pool[i].data, buffer_pool[i].size);
+    pooled_count = 0;
+}
+
+// --no-cache-pollution is for big jobs on shared hosts. Every input byte is
+// read once and every output byte written once, so none of it deserves a
+// place in the page cache at the expense of whatever else the machine is
+// running. The input is marked sequential, which has the kernel read further
+// ahead, and the next window is asked for before we get there. Each window
+// we're done with is then dropped right behind us. Written pages can only be
+// dropped once they're clean, so the output has its writeback started as
+// soon as a window fills, and is waited on and dropped a window later, by
+// which time the disk has normally caught up. Windows start on multiples of
+// their own size, because the cache can hold a file in pieces of up to 2 MB,
+// and a piece that straddles the edge of a range is left alone. The paths
+// that write at their own offsets (-j --pwrite, --io-uring) don't keep track
+// as they go; what they leave behind is dropped in one go at the end.
+#define CACHE_WINDOW (8 << 20)
+
+_Bool no_cache_pollution = 0;
+_Bool drop_input = 0;
+_Bool drop_output = 0;
+off_t input_position = 0;
+off_t input_dropped = 0;
+off_t output_position = 0;
+off_t output_started = 0;
+off_t output_dropped = 0;
+
+// consumed is the file offset the input is finished with up to. A mapped page
+// stays in the cache for as long as it's mapped, so on the mmap path our own
+// view of the window goes first; it's private and never written, so nothing
+// is lost.
+void drop_consumed_input(off_t consumed) {
+#ifdef __linux__
+    off_t end = consumed & ~(off_t)(CACHE_WINDOW - 1);
+    if (!drop_input || end <= input_dropped) return;
+
+    int fd = fileno(input_file);
+    if (input_map)
+        madvise(input_map + input_dropped, end - input_dropped, MADV_DONTNEED);
+    posix_fadvise(fd, input_dropped, end - input_dropped, POSIX_FADV_DONTNEED);
+    posix_fadvise(fd, consumed, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+    input_dropped = end;
+#else
+    (void)consumed;
+#endif
+}
+
+// Called after every write with how much it wrote.
+void drop_written_output(size_t length) {
+#ifdef __linux__
+    output_position += length;
+    off_t end = output_position & ~(off_t)(CACHE_WINDOW - 1);
+    if (!drop_output || end <= output_started) return;
+
+    int fd = fileno(output_file);
+    sync_file_range(fd, output_started, end - output_started,
+                    SYNC_FILE_RANGE_WRITE);
+    if (output_started > output_dropped) {
+        off_t span = output_started - output_dropped;
+        sync_file_range(fd, output_dropped, span,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, output_dropped, span, POSIX_FADV_DONTNEED);
+    }
+    output_dropped = output_started;
+    output_started = end;
+#else
+    (void)length;
+#endif
+}
+
+// The last of it, from cleanup(): whatever hasn't been dropped yet, which
+// for the paths that don't keep track is everything. A length of 0 means to
+// the end of the file for both calls.
+void drop_cached_files(void) {
+#ifdef __linux__
+    if (drop_output) {
+        int fd = fileno(output_file);
+        sync_file_range(fd, output_dropped, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, output_dropped, 0, POSIX_FADV_DONTNEED);
+    }
+    if (drop_input) {
+        if (input_map && !workers_running)
+            madvise(input_map, input_map_size, MADV_DONTNEED);
+        posix_fadvise(fileno(input_file), input_dropped, 0,
+                      POSIX_FADV_DONTNEED);
+    }
+#endif
+}
+
+// --verify checks the output against the input in the same pass, so a big
+// job doesn't have to read both files again afterwards to know nothing went
+// missing. Each side is hashed with CRC32C as it goes by, and its bytes and
+// line ends are counted. Reversal only moves bytes around within a line, or
+// lines around within the file, so the two sides must come to the same number
+// of bytes, the same number of delimiters and the same sum of byte values;
+// any difference is reported at the end, and the run fails. The CRCs can't
+// be compared with each other, since the output is in a different order, but
+// they're printed so they can be checked against whatever the storage keeps,
+// which is often CRC32C already.
+//
+// The input is hashed where it's reversed from, and the output where it's
+// written, before any compression. The sequential paths just carry on each
+// side's CRC; the -j workers and --tac see the data out of order, so their
+// pieces are hashed on their own and joined up in file order afterwards,
+// which CRCs allow for. CRC32C has its own instruction on x86 with SSE4.2
+// and on ARMv8 with the CRC extension; elsewhere it's done with a table.
+struct verify_count {
+    uint32_t crc;
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t byte_sum;
+};
+
+_Bool verifying = 0;
+struct verify_count verify_input;
+struct verify_count verify_output;
+
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+uint32_t crc32c_table[256];
+
+// Bytes and line ends are counted eight at a time, in 16-bit lanes for the
+// sum and 8-bit ones for the delimiters, which are added up every
+// VERIFY_RUN words, before any of them can overflow. The CRC instruction
+// takes a few cycles to come back with each word, and the counting fits in
+// that time, so it's done in the same loop rather than a pass of its own.
+#define VERIFY_RUN 127
+#define LANES_8 0x0101010101010101ull
+#define LANES_16 0x00ff00ff00ff00ffull
+
+static inline void count_word(uint64_t word, uint64_t pattern, uint64_t *sums,
+                              uint64_t *ends) {
+    uint64_t low = 0x7f7f7f7f7f7f7f7full;
+    uint64_t matched = word ^ pattern;
+    *sums += (word & LANES_16) + (word >> 8 & LANES_16);
+    *ends += ~(((matched & low) + low) | matched) >> 7 & LANES_8;
+}
+
+static inline uint64_t add_lanes_16(uint64_t lanes) {
+    return (lanes & 0xffff) + (lanes >> 16 & 0xffff) + (lanes >> 32 & 0xffff)
+           + (lanes >> 48);
+}
+
+// The loop every CRC step shares. It's always inlined, so each kind below
+// gets its own copy with its step built in.
+static inline __attribute__((always_inline))
+void verify_words(struct verify_count *count, const char *data, size_t length,
+                  uint32_t (*step)(uint32_t, uint64_t),
+                  uint32_t (*step_byte)(uint32_t, unsigned char)) {
+    unsigned char delimiter = options.delimiter;
+    uint64_t pattern = LANES_8 * delimiter;
+    uint32_t crc = ~count->crc;
+    count->bytes += length;
+    while (length >= 8) {
+        size_t words = length / 8 < VERIFY_RUN ? length / 8 : VERIFY_RUN;
+        uint64_t sums = 0, ends = 0;
+        for (size_t i = 0; i < words; i++) {
+            uint64_t word;
+            memcpy(&word, data + 8 * i, 8);
+            crc = step(crc, word);
+            count_word(word, pattern, &sums, &ends);
+        }
+        count->byte_sum += add_lanes_16(sums);
+        ends = (ends & LANES_16) + (ends >> 8 & LANES_16);
+        count->lines += add_lanes_16(ends);
+        data += 8 * words;
+        length -= 8 * words;
+    }
+    for (; length; data++, length--) {
+        unsigned char byte = *data;
+        crc = step_byte(crc, byte);
+        count->byte_sum += byte;
+        count->lines += byte == delimiter;
+    }
+    count->crc = ~crc;
+}
+
+static inline uint32_t table_step_byte(uint32_t crc, unsigned char byte) {
+    return crc32c_table[(crc ^ byte) & 0xff] ^ crc >> 8;
+}
+
+static inline uint32_t table_step(uint32_t crc, uint64_t word) {
+    for (int i = 0; i < 8; i++, word >>= 8) crc = table_step_byte(crc, word);
+    return crc;
+}
+
+void verify_add_table(struct verify_count *count, const char *data,
+                      size_t length) {
+    verify_words(count, data, length, table_step, table_step_byte);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t sse42_step(uint32_t crc, uint64_t word) {
+    return _mm_crc32_u64(crc, word);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t sse42_step_byte(uint32_t crc, unsigned char byte) {
+    return _mm_crc32_u8(crc, byte);
+}
+
+__attribute__((target("sse4.2")))
+void verify_add_sse42(struct verify_count *count, const char *data,
+                      size_t length) {
+    verify_words(count, data, length, sse42_step, sse42_step_byte);
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static inline uint32_t arm_step(uint32_t crc, uint64_t word) {
+    return __crc32cd(crc, word);
+}
+
+static inline uint32_t arm_step_byte(uint32_t crc, unsigned char byte) {
+    return __crc32cb(crc, byte);
+}
+
+void verify_add_arm(struct verify_count *count, const char *data,
+                    size_t length) {
+    verify_words(count, data, length, arm_step, arm_step_byte);
+}
+#endif
+
+// Carries count on over length more bytes of data.
+void (*verify_add)(struct verify_count *, const char *, size_t) =
+    verify_add_table;
+
+void prepare_verify(void) {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? crc >> 1 ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32c_table[byte] = crc;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) verify_add = verify_add_sse42;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    verify_add = verify_add_arm;
+#endif
+}
+
+// A length of 0 gives an empty count.
+struct verify_count verify_count_of(const char *data, size_t length) {
+    struct verify_count count = { 0, 0, 0, 0 };
+    verify_add(&count, data, length);
+    return count;
+}
+
+// Joining two CRCs means running the first one on through as many zero
+// bytes as the second covers, which is a matrix over GF(2) raised to that
+// power; squaring it a bit of the length at a time keeps that to a few
+// dozen small multiplications. This is zlib's crc32_combine(), with
+// CRC32C's polynomial.
+uint32_t gf2_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++)
+        if (vector & 1) sum ^= *matrix;
+    return sum;
+}
+
+void gf2_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(matrix, matrix[n]);
+}
+
+uint32_t crc32c_join(uint32_t first, uint32_t second, uint64_t length) {
+    uint32_t even[32], odd[32];
+    if (!length) return first;
+
+    odd[0] = CRC32C_POLYNOMIAL;
+    for (int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    for (;;) {
+        gf2_square(even, odd);
+        if (length & 1) first = gf2_times(even, first);
+        if (!(length >>= 1)) break;
+        gf2_square(odd, even);
+        if (length & 1) first = gf2_times(odd, first);
+        if (!(length >>= 1)) break;
+    }
+    return first ^ second;
+}
+
+// Puts piece after what count has seen so far.
+void verify_join(struct verify_count *count, struct verify_count piece) {
+    count->crc = crc32c_join(count->crc, piece.crc, piece.bytes);
+    count->bytes += piece.bytes;
+    count->lines += piece.lines;
+    count->byte_sum += piece.byte_sum;
+}
+
+// For --tac, which reads its input from the end backwards.
+void verify_add_before(struct verify_count *count, const char *data,
+                       size_t length) {
+    struct verify_count piece = verify_count_of(data, length);
+    verify_join(&piece, *count);
+    *count = piece;
+}
+
+// The -j workers' chunks, in whatever order they were finished. A chunk
+// whose output goes through the reorder stage has none here: that's hashed
+// on its way out like any other sequential output.
+struct verify_piece {
+    size_t start;
+    struct verify_count input;
+    struct verify_count output;
+};
+
+struct verify_piece *verify_pieces = NULL;
+size_t verify_piece_count = 0;
+size_t verify_piece_capacity = 0;
+pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void verify_chunk(size_t start, struct verify_count input,
+                  struct verify_count output) {
+    struct verify_piece piece = { start, input, output };
+    pthread_mutex_lock(&verify_lock);
+    if (verify_piece_count == verify_piece_capacity) {
+        size_t capacity = verify_piece_capacity ? 2 * verify_piece_capacity
+                                                : 64;
+        struct verify_piece *grown = realloc(verify_pieces,
+                                             capacity * sizeof *grown);
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            EXIT_ERR;
+        }
+        verify_pieces = grown;
+        verify_piece_capacity = capacity;
+    }
+    verify_pieces[verify_piece_count++] = piece;
+    pthread_mutex_unlock(&verify_lock);
+}
+
+int compare_verify_pieces(const void *a, const void *b) {
+    size_t first = ((const struct verify_piece *)a)->start;
+    size_t second = ((const struct verify_piece *)b)->start;
+    return (first > second) - (first < second);
+}
+
+// Once the workers are done. With --tac the output is the chunks from the
+// last to the first.
+void join_verified_chunks(_Bool output_from_end) {
+    qsort(verify_pieces, verify_piece_count, sizeof *verify_pieces,
+          compare_verify_pieces);
+    for (size_t i = 0; i < verify_piece_count; i++) {
+        size_t last = verify_piece_count - 1 - i;
+        verify_join(&verify_input, verify_pieces[i].input);
+        verify_join(&verify_output,
+                    verify_pieces[output_from_end ? last : i].output);
+    }
+    free(verify_pieces);
+    verify_pieces = NULL;
+    verify_piece_count = verify_piece_capacity = 0;
+}
+
+// From finish_output(), once everything has been written.
+void report_verify(void) {
+    const struct verify_count *in = &verify_input, *out = &verify_output;
+    fprintf(stderr, "verify: in  %" PRIu64 " bytes, %" PRIu64
+            " line ends, crc32c %08" PRIx32 "\n", in->bytes, in->lines,
+            in->crc);
+    fprintf(stderr, "verify: out %" PRIu64 " bytes, %" PRIu64
+            " line ends, crc32c %08" PRIx32 "\n", out->bytes, out->lines,
+            out->crc);
+
+    const char *problem = NULL;
+    if (in->byte_sum != out->byte_sum) problem = "the bytes themselves";
+    if (in->lines != out->lines) problem = "the number of lines";
+    if (in->bytes != out->bytes) problem = "the number of bytes";
+    if (problem) {
+        fprintf(stderr, "verify: the output differs from the input in %s\n",
+                problem);
+        EXIT_ERR;
+    }
+    fprintf(stderr, "verify: ok\n");
+}
+
+// Plain write(2) on the descriptor behind output_file. Nothing writes to
+// output_file through stdio anymore, so there's no stdio buffer to get out of
+// sync with. The loop covers short writes and signals.
+void write_raw(const char *data, size_t length) {
+    while (length) {
+        uint64_t started = stats_begin(STATS_WRITE);
+        ssize_t written = write(fileno(output_file), data, length);
+        stats_end(STATS_WRITE, started, written > 0 ? written : 0);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+        data += written;
+        length -= written;
+        if (no_cache_pollution) drop_written_output(written);
+    }
+}
+
+// Compressed output. An output file named *.gz or *.zst is compressed on its
+// way to the disk, so `zcat | reverse | zstd` can be one process. Everything
+// headed for the file already goes through write_all(), so that's the only
+// place that needs to know: the compressor's output collects in
+// compressed_output and goes to write_raw() a buffer at a time. zstd spreads
+// the work over a thread per CPU, or -j of them; zlib has no threads, so
+// gzip is compressed inline. What's left in the compressor is written out by
+// finish_output() from EXIT_SUCC, so a run that fails leaves a stream that
+// visibly doesn't end, rather than one that looks whole.
+//
+// Reading compressed files is further down, with the block path. Either
+// format needs its library: build with -DHAVE_ZLIB -lz and -DHAVE_ZSTD
+// -lzstd.
+#define COMPRESSION_PIECE (1 << 30)
+
+char *compressed_output = NULL;
+size_t compressed_output_size = 0;
+
+#ifdef HAVE_ZLIB
+z_stream deflater;
+#endif
+#ifdef HAVE_ZSTD
+ZSTD_CCtx *zstd_compressor = NULL;
+#endif
+
+// zlib counts in 32 bits, so a line of several gigabytes written straight
+// from the mapping goes in a gigabyte at a time.
+void compress_output(const char *data, size_t length, _Bool finish) {
+#ifdef HAVE_ZLIB
+    if (output_compression == COMPRESSION_GZIP) {
+        do {
+            size_t piece = length < COMPRESSION_PIECE ? length
+                                                      : COMPRESSION_PIECE;
+            int flush = finish && piece == length ? Z_FINISH : Z_NO_FLUSH;
+            deflater.next_in = (Bytef *)data;
+            deflater.avail_in = piece;
+            do {
+                deflater.next_out = (Bytef *)compressed_output;
+                deflater.avail_out = compressed_output_size;
+                if (deflate(&deflater, flush) == Z_STREAM_ERROR) {
+                    fprintf(stderr, "Error compressing output\n");
+                    EXIT_ERR;
+                }
+                write_raw(compressed_output,
+                          compressed_output_size - deflater.avail_out);
+            } while (deflater.avail_out == 0);
+            data += piece;
+            length -= piece;
+        } while (length);
+        return;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (output_compression == COMPRESSION_ZSTD) {
+        ZSTD_inBuffer in = { data, length, 0 };
+        ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out = { compressed_output, compressed_output_size,
+                                   0 };
+            remaining = ZSTD_compressStream2(zstd_compressor, &out, &in, mode);
+            if (ZSTD_isError(remaining)) {
+                fprintf(stderr, "Error compressing output: %s\n",
+                        ZSTD_getErrorName(remaining));
+                EXIT_ERR;
+            }
+            write_raw(compressed_output, out.pos);
+        } while (finish ? remaining != 0 : in.pos < in.size);
+        return;
+    }
+#endif
+    (void)data;
+    (void)length;
+    (void)finish;
+}
+
+void write_all(const char *data, size_t length) {
+    if (verifying) verify_add(&verify_output, data, length);
+    if (output_compression) {
+        compress_output(data, length, 0);
+        return;
+    }
+    write_raw(data, length);
+}
+
+// Filesystems that can't do O_DIRECT refuse the flag here, and the file just
+// carries on through the page cache.
+_Bool set_direct(int fd, _Bool on) {
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return 0;
+    flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return fcntl(fd, F_SETFL, flags) == 0;
+#else
+    (void)fd;
+    (void)on;
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+// If the kernel turns vmsplice down (some pipe-like files don't support it),
+// the rest of the run just uses write. Nothing has been handed over yet in
+// that case, so the buffer is still ours.
+void splice_all(const char *data, size_t length) {
+    while (length) {
+        struct iovec pages = { (void *)data, length };
+        uint64_t started = stats_begin(STATS_WRITE);
+        ssize_t spliced = vmsplice(fileno(output_file), &pages, 1, 0);
+        stats_end(STATS_WRITE, started, spliced > 0 ? spliced : 0);
+        if (spliced < 0 && errno == EINTR) continue;
+        if (spliced < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            splice_output = 0;
+            write_all(data, length);
+            return;
+        }
+        if (spliced <= 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+        if (verifying) verify_add(&verify_output, data, spliced);
+        data += spliced;
+        length -= spliced;
+    }
+}
+#endif
+
+void flush_output(void) {
+#ifdef __linux__
+    if (splice_output) {
+        splice_all(output_buffer, output_buffer_used);
+        char *spliced = output_buffer;
+        output_buffer = output_spare;
+        output_spare = spliced;
+        output_buffer_used = 0;
+        return;
+    }
+#endif
+    if (direct_output && output_buffer_used % BUFFER_ALIGNMENT) {
+        set_direct(fileno(output_file), 0);
+        direct_output = 0;
+    }
+    write_all(output_buffer, output_buffer_used);
+    output_buffer_used = 0;
+}
+
+// Appends raw bytes to the output buffer. Anything that wouldn't fit even in an
+// empty buffer skips it entirely, since copying it first would gain nothing.
+// The exception is splicing, where only whole buffers can go to the pipe.
+void output_bytes(const char *data, size_t length) {
+    if (output_buffer_used + length > output_buffer_size && !splice_output)
+        flush_output();
+    if (length > output_buffer_size && !splice_output && !direct_output) {
+        write_all(data, length);
+        return;
+    }
+    while (length) {
+        if (output_buffer_used == output_buffer_size) flush_output();
+
+        size_t room = output_buffer_size - output_buffer_used;
+        size_t piece = length < room ? length : room;
+        memcpy(output_buffer + output_buffer_used, data, piece);
+        output_buffer_used += piece;
+        data += piece;
+        length -= piece;
+    }
+}
+
+// Characters can't be cut in half the way bytes can, so in --utf8 mode a line
+// that doesn't fit in what's left of the buffer is done from its end in
+// pieces, cut wherever libreverse can tell a unit starts. Only a line with
+// nowhere to cut, like a buffer-full of combining marks in a row, is reversed
+// into this scratch space first and then copied in.
+char *text_scratch = NULL;
+size_t text_scratch_size = 0;
+
+void output_reversed_text_through_scratch(const char *data, size_t length) {
+    if (length > text_scratch_size) {
+        give_buffer(text_scratch, text_scratch_size);
+        text_scratch = take_buffer(length, &text_scratch_size);
+    }
+    reverse_text(&reverser, text_scratch, data, length);
+    output_bytes(text_scratch, length);
+}
+
+// A partly filled buffer can't be spliced, so when splicing, the scratch
+// space is the only way around a piece that won't fit.
+void output_reversed_text(const char *data, size_t length) {
+    while (length > output_buffer_size - output_buffer_used) {
+        size_t room = output_buffer_size - output_buffer_used;
+        size_t cut = reverse_unit_boundary(&reverser, data, length,
+                                           length - room);
+        if (cut == length && output_buffer_used && !splice_output) {
+            flush_output();
+            continue;
+        }
+        if (cut == length) {
+            output_reversed_text_through_scratch(data, length);
+            return;
+        }
+
+        reverse_text(&reverser, output_buffer + output_buffer_used,
+                     data + cut, length - cut);
+        output_buffer_used += length - cut;
+        length = cut;
+    }
+
+    reverse_text(&reverser, output_buffer + output_buffer_used, data, length);
+    output_buffer_used += length;
+}
+
+// A line has to be whole before it can be split into fields, so with fields
+// it goes into the buffer in one go, or through the scratch space if there's
+// no room even after a flush.
+void output_reversed_fields(const char *data, size_t length) {
+    if (length > output_buffer_size - output_buffer_used && output_buffer_used
+        && !splice_output)
+        flush_output();
+    if (length > output_buffer_size - output_buffer_used) {
+        if (length > text_scratch_size) {
+            give_buffer(text_scratch, text_scratch_size);
+            text_scratch = take_buffer(length, &text_scratch_size);
+        }
+        reverse_record(&reverser, text_scratch, data, length);
+        output_bytes(text_scratch, length);
+        return;
+    }
+
+    reverse_record(&reverser, output_buffer + output_buffer_used, data, length);
+    output_buffer_used += length;
+}
+
+// Appends the reverse of data to the output buffer. The reversal writes
+// directly into the buffer, so there's no intermediate copy. A line longer
+// than the buffer is handled from its end backwards, one buffer-full at a
+// time, which keeps memory use at output_buffer_size no matter the line.
+void output_reversed(const char *data, size_t length) {
+    if (splitting_fields()) {
+        output_reversed_fields(data, length);
+        return;
+    }
+    if (options.text_mode != REVERSE_BYTES) {
+        output_reversed_text(data, length);
+        return;
+    }
+
+    while (length) {
+        if (output_buffer_used == output_buffer_size) flush_output();
+
+        size_t room = output_buffer_size - output_buffer_used;
+        size_t piece = length < room ? length : room;
+
+        reverse_bytes(output_buffer + output_buffer_used,
+                     data + length - piece, piece);
+
+        output_buffer_used += piece;
+        length -= piece;
+    }
+}
+
+// The heart of this little example, for the mmap path. As many lines of the
+// batch as fit in what's left of the output buffer are reversed straight into
+// it by libreverse in one go. A line that doesn't fit is done on its own,
+// from its end a buffer-full at a time, which flushes along the way. The
+// terminator stays at the end, and a final line without one is reversed
+// whole.
+void reverse_region_lines(void) {
+    size_t start = input_region_offset;
+    size_t batch_length = line_ends[line_count - 1] - start;
+    uint64_t started = stats_begin_batch(input_region + start, batch_length, 0);
+    if (verifying)
+        verify_add(&verify_input, input_region + start, batch_length);
+    for (size_t done = 0; done < line_count;) {
+        size_t room = output_buffer_size - output_buffer_used;
+        size_t fit = done;
+        while (fit < line_count && line_ends[fit] - start <= room) fit++;
+        if (fit > done) {
+            reverse_record_batch(&reverser, output_buffer + output_buffer_used,
+                                 input_region, start, line_ends + done,
+                                 fit - done);
+            output_buffer_used += line_ends[fit - 1] - start;
+            start = line_ends[fit - 1];
+            done = fit;
+            continue;
+        }
+
+        size_t end = line_ends[done++];
+        size_t kept = reverse_terminator_length(&reverser, input_region + start,
+                                                end - start);
+        output_reversed(input_region + start, end - start - kept);
+        output_bytes(input_region + end - kept, kept);
+        start = end;
+    }
+    input_region_offset = start;
+    stats_end_batch(started, batch_length);
+    if (no_cache_pollution)
+        drop_consumed_input(input_region - input_map + input_region_offset);
+}
+
+// --range and --shard are for files too big for one machine. Each line is
+// reversed where it stands, so any stretch of whole lines can be done on its
+// own, and a file can be split between as many machines as can see it. A
+// range owns the lines that start inside it: both of its ends are moved on to
+// just past the next delimiter, unless they're already at the start or end
+// of the file. Ranges that meet end to end, as the ones --shard cuts always
+// do, share out every line exactly once however the ends fall.
+//
+// The output goes to the same offsets of the out-file, which is left as it
+// is apart from being sized to match the input, so every shard can write into
+// one shared file at once. With --part, or an out-file that isn't a regular
+// file, just the range is written, from the start, and the parts put back
+// together in order are the whole output. --plan shows where a set of ranges
+// ends up and checks that they tile the file, before anything is run.
+//
+// --shard K/N is the K-th of N equal ranges, counted from 1 the way split -n
+// does.
+_Bool range_given = 0;
+size_t range_first = 0;
+size_t range_last = SIZE_MAX;
+long shard_index = 0;
+long shard_count = 0;
+_Bool part_output = 0;
+size_t range_start = 0;
+size_t range_end = 0;
+size_t part_offset = 0;
+
+// Where the k-th of count equal shares of size starts, without overflowing.
+size_t shard_offset(size_t size, long k, long count) {
+    return size / count * k + size % count * k / count;
+}
+
+// Moves offset on to the start of the line it's in the middle of, reading
+// from fd rather than the mapping, since --plan doesn't map anything.
+size_t snap_to_line(int fd, size_t offset, size_t size) {
+    if (offset == 0 || offset >= size) return offset < size ? offset : size;
+
+    char block[1 << 16];
+    size_t position = offset - 1;
+    while (position < size) {
+        ssize_t got = pread(fd, block, sizeof block, position);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+        if (got == 0) break;
+        const char *found = memchr(block, options.delimiter, got);
+        if (found) return position + (found - block) + 1;
+        position += got;
+    }
+    return size;
+}
+
+// --affinity places the -j workers. With --affinity=cpus each one is pinned
+// to a CPU of its own, round the ones we're allowed. With --affinity, or
+// --affinity=nodes, they're dealt out over the NUMA nodes instead, each
+// pinned to its node's CPUs and told to take its memory from that node, so
+// chunk buffers and whatever of the input it faults into the page cache are
+// local. A buffer from the pool may have been touched on another node before,
+// so the ones a worker takes are moved over as well.
+//
+// When every worker writes for itself (--pwrite, --in-place), the mapped
+// input is also cut up by node: each node gets its own stretch of lines and
+// its workers claim chunks from there, and only move on to another node's
+// once theirs runs out. The reorder stage has to have chunks in file order,
+// so there the workers are placed but the chunks still come in turn.
+//
+// The topology comes from sysfs, and the rest is plain system calls, the same
+// as io_uring, so there's no libnuma to link. Anywhere else, or on a machine
+// with one node, --affinity=nodes comes down to the one node and leaves the
+// kernel's memory policy alone.
+#define MAX_NODE_ID 256
+#define NODE_MASK_BITS (8 * sizeof(unsigned long))
+
+enum affinity { AFFINITY_NONE, AFFINITY_CPUS, AFFINITY_NODES };
+
+struct node {
+    int id;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    size_t region_next;
+    size_t region_end;
+};
+
+enum affinity affinity = AFFINITY_NONE;
+struct node nodes[MAX_NODES];
+int node_count = 0;
+_Bool chunks_by_node = 0;
+_Thread_local int worker_node = -1;
+
+#ifdef __linux__
+cpu_set_t allowed_cpus;
+
+// A cpulist is what sysfs uses, like "0-3,8-11".
+void parse_cpu_list(const char *text, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*text && *text != '\n') {
+        char *end;
+        long first = strtol(text, &end, 10), last = first;
+        if (end == text) return;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, cpus);
+        text = *end == ',' ? end + 1 : end;
+    }
+}
+
+// Nodes with memory but no CPUs we may use are left out.
+void find_nodes(void) {
+    CPU_ZERO(&allowed_cpus);
+    sched_getaffinity(0, sizeof allowed_cpus, &allowed_cpus);
+
+    for (int id = 0; id < MAX_NODE_ID && node_count < MAX_NODES; id++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+                 id);
+        FILE *file = fopen(path, "r");
+        if (!file) continue;
+        size_t got = fread(list, 1, sizeof list - 1, file);
+        fclose(file);
+        list[got] = '\0';
+
+        struct node *node = &nodes[node_count];
+        parse_cpu_list(list, &node->cpus);
+        CPU_AND(&node->cpus, &node->cpus, &allowed_cpus);
+        if (!CPU_COUNT(&node->cpus)) continue;
+        node->id = node_stats[node_count].id = id;
+        node_count++;
+    }
+    if (!node_count) {
+        nodes[0].id = node_stats[0].id = -1;
+        nodes[0].cpus = allowed_cpus;
+        node_count = 1;
+    }
+    stats_node_count = node_count;
+}
+
+// The n-th CPU we're allowed, counting round as often as it takes.
+int nth_allowed_cpu(long n) {
+    n %= CPU_COUNT(&allowed_cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed_cpus) && n-- == 0) return cpu;
+    }
+    return 0;
+}
+
+#ifdef HAVE_MEMPOLICY
+void set_node_mask(unsigned long *mask, int id) {
+    memset(mask, 0, MAX_NODE_ID / 8);
+    mask[id / NODE_MASK_BITS] |= 1UL << id % NODE_MASK_BITS;
+}
+#endif
+
+void bind_to_worker_node(void *buffer, size_t size) {
+#ifdef HAVE_MEMPOLICY
+    if (worker_node < 0 || nodes[worker_node].id < 0 || !buffer) return;
+    unsigned long mask[MAX_NODE_ID / NODE_MASK_BITS];
+    set_node_mask(mask, nodes[worker_node].id);
+    syscall(SYS_mbind, buffer, size, MPOL_PREFERRED, mask, MAX_NODE_ID,
+            MPOL_MF_MOVE);
+#else
+    (void)buffer;
+    (void)size;
+#endif
+}
+
+// Called by each worker as it starts, with its number.
+void place_worker(long index) {
+    if (affinity == AFFINITY_CPUS) {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(nth_allowed_cpu(index), &cpu);
+        pthread_setaffinity_np(pthread_self(), sizeof cpu, &cpu);
+        return;
+    }
+    if (affinity != AFFINITY_NODES) return;
+
+    worker_node = stats_node = index % node_count;
+    struct node *node = &nodes[worker_node];
+    stats_add(&node_stats[worker_node].workers, 1);
+    pthread_setaffinity_np(pthread_self(), sizeof node->cpus, &node->cpus);
+#ifdef HAVE_MEMPOLICY
+    if (node->id < 0) return;
+    unsigned long mask[MAX_NODE_ID / NODE_MASK_BITS];
+    set_node_mask(mask, node->id);
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODE_ID);
+#endif
+}
+#else
+void find_nodes(void) {
+    nodes[0].id = node_stats[0].id = -1;
+    node_count = stats_node_count = 1;
+}
+
+void bind_to_worker_node(void *buffer, size_t size) {
+    (void)buffer;
+    (void)size;
+}
+
+void place_worker(long index) {
+    if (affinity == AFFINITY_NODES) {
+        worker_node = stats_node = 0;
+        stats_add(&node_stats[0].workers, 1);
+    }
+    (void)index;
+}
+#endif
+
+// The workers' take_buffer().
+char *take_local_buffer(size_t size, size_t *capacity) {
+    char *buffer = take_buffer(size, capacity);
+    bind_to_worker_node(buffer, *capacity);
+    return buffer;
+}
+
+// Each node's stretch ends just past the first line end at or after its
+// share of the input. A line long enough to cover a whole share leaves that
+// node with nothing of its own.
+void split_input_by_node(void) {
+    size_t first = input_region - input_map;
+    size_t limit = first + input_region_size;
+    size_t start = first;
+    for (int i = 0; i < node_count; i++) {
+        size_t end = limit;
+        size_t share = first
+                       + shard_offset(input_region_size, i + 1, node_count);
+        if (i < node_count - 1) {
+            end = start;
+            if (share > start) {
+                const char *newline = memchr(input_map + share - 1,
+                                             options.delimiter,
+                                             limit - share + 1);
+                end = newline ? (size_t)(newline - input_map) + 1 : limit;
+            }
+        }
+        nodes[i].region_next = start;
+        nodes[i].region_end = end;
+        start = end;
+    }
+}
+
+// The reorder stage. There are twice as many slots as workers, and chunk c
+// always goes into slot c % slot_count. A worker waits until its slot has been
+// written out and handed on to chunk c, fills it, and marks it ready. main()
+// walks the chunks in order, waiting for each slot to become ready before
+// writing it, so the output matches the single-threaded run byte for byte.
+struct chunk_slot {
+    char *buffer;
+    size_t capacity;
+    size_t length;
+    size_t chunk;
+    _Bool ready;
+};
+
+struct chunk_slot *slots = NULL;
+size_t slot_count = 0;
+
+// Chunks are cut as they're claimed: each one starts where the previous one
+// ended and runs chunk_size bytes, then on to just past the next newline. So
+// every chunk holds whole lines, and the newline search never covers the same
+// bytes twice even when one line is many chunks long. chunk_count isn't known
+// until the last chunk has been claimed. The chunks run from the start of the
+// input region to chunks_end, which is the whole file unless --range says
+// otherwise.
+size_t next_chunk = 0;
+size_t next_chunk_start = 0;
+size_t chunks_end = 0;
+size_t chunk_count = SIZE_MAX;
+
+pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_filled = PTHREAD_COND_INITIALIZER;
+pthread_cond_t slot_emptied = PTHREAD_COND_INITIALIZER;
+
+// With --tac the chunks are cut from the end of the file backwards, so chunk
+// 0 is the one that's written first, and --pwrite writes each one at the
+// offset it mirrors.
+size_t next_chunk_end = 0;
+
+_Bool claim_chunk_from_end(size_t *chunk, size_t *start, size_t *end) {
+    if (!next_chunk_end) {
+        chunk_count = next_chunk;
+        pthread_cond_broadcast(&slot_filled);
+        return 0;
+    }
+
+    *chunk = next_chunk++;
+    *start = 0;
+    *end = next_chunk_end;
+    if (*end > chunk_size) {
+        const char *newline = memrchr(input_map, options.delimiter,
+                                      *end - chunk_size);
+        if (newline) *start = newline - input_map + 1;
+    }
+    next_chunk_end = *start;
+    return 1;
+}
+
+// Where a chunk starting at start ends, if the input stopped at limit.
+size_t cut_chunk(size_t start, size_t limit) {
+    if (limit - start <= chunk_size) return limit;
+    size_t nominal = start + chunk_size;
+    const char *newline = memchr(input_map + nominal - 1, options.delimiter,
+                                 limit - nominal + 1);
+    return newline ? (size_t)(newline - input_map) + 1 : limit;
+}
+
+// The worker's own node first, then the others in turn. With --tac the
+// chunks are cut forwards here too; they only need to be in order for the
+// reorder stage, which doesn't claim by node.
+_Bool claim_node_chunk(size_t *chunk, size_t *start, size_t *end) {
+    int home = worker_node < 0 ? 0 : worker_node;
+    for (int i = 0; i < node_count; i++) {
+        struct node *node = &nodes[(home + i) % node_count];
+        if (node->region_next >= node->region_end) continue;
+        *chunk = next_chunk++;
+        *start = node->region_next;
+        *end = cut_chunk(*start, node->region_end);
+        node->region_next = *end;
+        return 1;
+    }
+    chunk_count = next_chunk;
+    return 0;
+}
+
+// Must be called with slot_lock held.
+_Bool claim_chunk(size_t *chunk, size_t *start, size_t *end) {
+    if (chunks_by_node) return claim_node_chunk(chunk, start, end);
+    if (tac_mode) return claim_chunk_from_end(chunk, start, end);
+    if (next_chunk_start >= chunks_end) {
+        chunk_count = next_chunk;
+        pthread_cond_broadcast(&slot_filled);
+        return 0;
+    }
+
+    *chunk = next_chunk++;
+    *start = next_chunk_start;
+    *end = cut_chunk(*start, chunks_end);
+    next_chunk_start = *end;
+    return 1;
+}
+
+void reverse_chunk(char *dst, size_t start, size_t end) {
+    uint64_t started = stats_begin_batch(input_map + start, end - start, 0);
+    if (tac_mode)
+        reverse_record_order(&reverser, dst, input_map + start, end - start,
+                             tac_reverse_lines);
+    else
+        reverse_records(&reverser, dst, input_map + start, end - start);
+    stats_end_batch(started, end - start);
+    if (verifying)
+        verify_chunk(start, verify_count_of(input_map + start, end - start),
+                     verify_count_of(dst, slots ? 0 : end - start));
+}
+
+void *reverse_chunks(void *index) {
+    place_worker((intptr_t)index);
+    size_t chunk, start, end;
+    for (;;) {
+        pthread_mutex_lock(&slot_lock);
+        _Bool claimed = claim_chunk(&chunk, &start, &end);
+        pthread_mutex_unlock(&slot_lock);
+        if (!claimed) return NULL;
+
+        struct chunk_slot *slot = &slots[chunk % slot_count];
+        pthread_mutex_lock(&slot_lock);
+        while (slot->chunk != chunk)
+            pthread_cond_wait(&slot_emptied, &slot_lock);
+        pthread_mutex_unlock(&slot_lock);
+
+        if (end - start > slot->capacity) {
+            give_buffer(slot->buffer, slot->capacity);
+            slot->buffer = take_local_buffer(end - start, &slot->capacity);
+        }
+        reverse_chunk(slot->buffer, start, end);
+        slot->length = end - start;
+
+        pthread_mutex_lock(&slot_lock);
+        slot->ready = 1;
+        pthread_cond_broadcast(&slot_filled);
+        pthread_mutex_unlock(&slot_lock);
+    }
+}
+
+// Reversing a line never changes its length, so a chunk's output belongs at
+// exactly the offset it was read from. With --pwrite every worker writes its
+// own chunks straight there, and there's no reorder stage and no single
+// writer to wait on. Each worker keeps one buffer for all of its chunks.
+void pwrite_all(const char *data, size_t length, off_t offset) {
+    while (length) {
+        uint64_t started = stats_begin(STATS_WRITE);
+        ssize_t written = pwrite(fileno(output_file), data, length, offset);
+        stats_end(STATS_WRITE, started, written > 0 ? written : 0);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+void *reverse_chunks_to_offsets(void *index) {
+    place_worker((intptr_t)index);
+    char *buffer = NULL;
+    size_t capacity = 0;
+    size_t chunk, start, end;
+    for (;;) {
+        pthread_mutex_lock(&slot_lock);
+        _Bool claimed = claim_chunk(&chunk, &start, &end);
+        pthread_mutex_unlock(&slot_lock);
+        if (!claimed) break;
+
+        if (end - start > capacity) {
+            give_buffer(buffer, capacity);
+            buffer = take_local_buffer(end - start, &capacity);
+        }
+        reverse_chunk(buffer, start, end);
+        pwrite_all(buffer, end - start,
+                   tac_mode ? input_map_size - end : start - part_offset);
+    }
+    give_buffer(buffer, capacity);
+    return NULL;
+}
+
+// The --in-place worker. Claiming works the same as for the other workers,
+// but there's nothing to write: the chunk is reversed inside the shared
+// mapping and the kernel writes it back.
+void *reverse_chunks_in_place(void *index) {
+    place_worker((intptr_t)index);
+    size_t chunk, start, end;
+    for (;;) {
+        pthread_mutex_lock(&slot_lock);
+        _Bool claimed = claim_chunk(&chunk, &start, &end);
+        pthread_mutex_unlock(&slot_lock);
+        if (!claimed) return NULL;
+
+        struct verify_count before = verify_count_of(input_map + start,
+                                                     verifying ? end - start
+                                                               : 0);
+        uint64_t started = stats_begin_batch(input_map + start, end - start, 0);
+        reverse_records(&reverser, input_map + start, input_map + start,
+                        end - start);
+        stats_end_batch(started, end - start);
+        if (verifying)
+            verify_chunk(start, before,
+                         verify_count_of(input_map + start, end - start));
+    }
+}
+
+// pwrite needs something seekable to write into. The file is sized up front
+// so workers finishing out of order never leave a short file behind them.
+_Bool presize_output(void) {
+    struct stat info;
+    if (fstat(fileno(output_file), &info) != 0 || !S_ISREG(info.st_mode))
+        return 0;
+    size_t size = part_output ? input_region_size : input_map_size;
+    return ftruncate(fileno(output_file), size) == 0;
+}
+
+void write_chunks_in_order(void) {
+    for (size_t chunk = 0; ; chunk++) {
+        struct chunk_slot *slot = &slots[chunk % slot_count];
+
+        pthread_mutex_lock(&slot_lock);
+        while (chunk < chunk_count && (slot->chunk != chunk || !slot->ready))
+            pthread_cond_wait(&slot_filled, &slot_lock);
+        pthread_mutex_unlock(&slot_lock);
+        if (chunk >= chunk_count) return;
+
+        write_all(slot->buffer, slot->length);
+
+        pthread_mutex_lock(&slot_lock);
+        slot->ready = 0;
+        slot->chunk = chunk + slot_count;
+        pthread_cond_broadcast(&slot_emptied);
+        pthread_mutex_unlock(&slot_lock);
+    }
+}
+
+// With --in-place, or --pwrite and a regular output file, the workers write
+// for themselves and all that's left to do here is wait for them. Anything
+// else (a pipe, a terminal) falls back to the reorder stage.
+void reverse_in_parallel(void) {
+    pthread_t workers[MAX_THREADS];
+    void *(*worker)(void *) = reverse_chunks;
+
+    if (in_place) {
+        worker = reverse_chunks_in_place;
+    } else if (use_pwrite && presize_output()) {
+        worker = reverse_chunks_to_offsets;
+    } else {
+        slot_count = 2 * thread_count;
+        slots = calloc(slot_count, sizeof *slots);
+        if (!slots) {
+            fprintf(stderr, "Out of memory\n");
+            EXIT_ERR;
+        }
+        for (size_t i = 0; i < slot_count; i++) slots[i].chunk = i;
+    }
+
+    next_chunk_start = input_region - input_map;
+    chunks_end = next_chunk_start + input_region_size;
+    next_chunk_end = input_map_size;
+    if (affinity != AFFINITY_NONE) find_nodes();
+    chunks_by_node = affinity == AFFINITY_NODES && !slots && node_count > 1;
+    if (chunks_by_node) split_input_by_node();
+    workers_running = 1;
+    for (long i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i], NULL, worker, (void *)(intptr_t)i)
+            != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            EXIT_ERR;
+        }
+    }
+
+    if (slots) write_chunks_in_order();
+
+    for (long i = 0; i < thread_count; i++) pthread_join(workers[i], NULL);
+    workers_running = 0;
+    if (verifying) join_verified_chunks(tac_mode);
+}
+
+// Fills line_ends with the next batch of boundaries in the input region, in
+// one pass of the vector scanner. If the scan reaches the end of the region
+// before the batch fills up, whatever is left after the last newline becomes
+// one more line. Returns 0 once there are no more lines.
+_Bool find_region_lines(void) {
+    size_t remaining = input_region_size - input_region_offset;
+    if (!remaining) return 0;
+
+    line_count = reverse_find_record_ends(&reverser,
+                                          input_region + input_region_offset,
+                                          remaining, line_ends,
+                                          LINE_BATCH_SIZE);
+    for (size_t i = 0; i < line_count; i++)
+        line_ends[i] += input_region_offset;
+
+    size_t scanned_to = line_count ? line_ends[line_count - 1]
+                                   : input_region_offset;
+    if (line_count < LINE_BATCH_SIZE && scanned_to < input_region_size)
+        line_ends[line_count++] = input_region_size;
+    return line_count > 0;
+}
+
+// Compressed input is recognised by its first bytes, not its name, so it
+// works from a pipe too. It can't be mapped, so it always takes the block
+// path, with the decompressing done on a thread of its own. That thread
+// fills a ring of INFLATE_DEPTH blocks while the main thread reverses and
+// writes the ones before, and a full block is swapped with input_block
+// rather than copied. Neither gzip nor zstd can be decompressed in parallel
+// without an index of where it's safe to start, which plain .gz and .zst
+// files don't have, so one thread overlapping the rest of the work is as
+// parallel as it gets. A file of several gzip members, like pigz makes, or
+// of several zstd frames is read straight through.
+#define INFLATE_DEPTH 4
+
+struct inflate_slot {
+    char *data;
+    size_t capacity;
+    size_t length;
+    _Bool full;
+};
+
+struct inflate_slot inflate_slots[INFLATE_DEPTH];
+size_t inflate_next = 0;
+pthread_mutex_t inflate_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inflate_filled = PTHREAD_COND_INITIALIZER;
+pthread_cond_t inflate_emptied = PTHREAD_COND_INITIALIZER;
+
+// Telling what the input is means reading its first few bytes. When the
+// input can't seek back over them, like a pipe, they wait in input_magic for
+// whichever reader comes first.
+char input_magic[4];
+size_t input_magic_length = 0;
+
+char *compressed_input = NULL;
+size_t compressed_input_size = 0;
+_Bool compressed_input_ended = 0;
+
+#ifdef HAVE_ZLIB
+z_stream inflater;
+_Bool gzip_member_open = 0;
+#endif
+#ifdef HAVE_ZSTD
+ZSTD_DCtx *zstd_decompressor = NULL;
+ZSTD_inBuffer zstd_input = { NULL, 0, 0 };
+_Bool zstd_frame_open = 0;
+#endif
+
+// Hands back the magic bytes first, if they're still waiting.
+size_t read_magic(char *buffer) {
+    size_t length = input_magic_length;
+    memcpy(buffer, input_magic, length);
+    input_magic_length = 0;
+    return length;
+}
+
+size_t read_compressed(void) {
+    if (input_magic_length) return read_magic(compressed_input);
+    for (;;) {
+        uint64_t started = stats_begin(STATS_READ);
+        ssize_t got = read(fileno(input_file), compressed_input,
+                           compressed_input_size);
+        stats_end(STATS_READ, started, got > 0 ? got : 0);
+        if (got > 0 && no_cache_pollution)
+            drop_consumed_input(input_position += got);
+        if (got == 0) compressed_input_ended = 1;
+        if (got >= 0) return got;
+        if (errno != EINTR) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+    }
+}
+
+// Both decompressors can still be holding output when their input runs dry,
+// so the end of the input only counts once they've stopped making progress.
+size_t inflate_block(char *buffer, size_t capacity) {
+#ifdef HAVE_ZLIB
+    if (input_compression == COMPRESSION_GZIP) {
+        inflater.next_out = (Bytef *)buffer;
+        inflater.avail_out = capacity;
+        while (inflater.avail_out) {
+            if (!inflater.avail_in && !compressed_input_ended) {
+                inflater.next_in = (Bytef *)compressed_input;
+                inflater.avail_in = read_compressed();
+            }
+            int status = inflate(&inflater, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                gzip_member_open = 0;
+                inflateReset(&inflater);
+            } else if (status == Z_OK) {
+                gzip_member_open = 1;
+            } else if (status == Z_BUF_ERROR && compressed_input_ended
+                       && !inflater.avail_in) {
+                break;
+            } else if (status != Z_BUF_ERROR) {
+                fprintf(stderr, "Error decompressing input: %s\n",
+                        inflater.msg ? inflater.msg : "corrupt data");
+                EXIT_ERR;
+            }
+        }
+        if (gzip_member_open && compressed_input_ended && !inflater.avail_in
+            && inflater.avail_out) {
+            fprintf(stderr, "Error decompressing input: it's cut short\n");
+            EXIT_ERR;
+        }
+        return capacity - inflater.avail_out;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (input_compression == COMPRESSION_ZSTD) {
+        ZSTD_outBuffer out = { buffer, capacity, 0 };
+        while (out.pos < out.size) {
+            if (zstd_input.pos == zstd_input.size && !compressed_input_ended) {
+                zstd_input.src = compressed_input;
+                zstd_input.size = read_compressed();
+                zstd_input.pos = 0;
+            }
+            size_t produced = out.pos, consumed = zstd_input.pos;
+            size_t hint = ZSTD_decompressStream(zstd_decompressor, &out,
+                                                &zstd_input);
+            if (ZSTD_isError(hint)) {
+                fprintf(stderr, "Error decompressing input: %s\n",
+                        ZSTD_getErrorName(hint));
+                EXIT_ERR;
+            }
+            if (out.pos != produced || zstd_input.pos != consumed)
+                zstd_frame_open = hint != 0;
+            else if (compressed_input_ended)
+                break;
+        }
+        if (zstd_frame_open && out.pos < out.size) {
+            fprintf(stderr, "Error decompressing input: it's cut short\n");
+            EXIT_ERR;
+        }
+        return out.pos;
+    }
+#endif
+    (void)buffer;
+    (void)capacity;
+    return 0;
+}
+
+// The decompressing thread. An empty block marks the end of the input.
+void *inflate_input(void *unused) {
+    (void)unused;
+    for (size_t block = 0; ; block++) {
+        struct inflate_slot *slot = &inflate_slots[block % INFLATE_DEPTH];
+        pthread_mutex_lock(&inflate_lock);
+        while (slot->full) pthread_cond_wait(&inflate_emptied, &inflate_lock);
+        pthread_mutex_unlock(&inflate_lock);
+
+        slot->length = inflate_block(slot->data, slot->capacity);
+
+        pthread_mutex_lock(&inflate_lock);
+        slot->full = 1;
+        pthread_cond_broadcast(&inflate_filled);
+        pthread_mutex_unlock(&inflate_lock);
+        if (!slot->length) return NULL;
+    }
+}
+
+// The block path's side of the ring. The empty block at the end stays put, so
+// asking again just gets the end again.
+size_t take_inflated_block(void) {
+    struct inflate_slot *slot = &inflate_slots[inflate_next % INFLATE_DEPTH];
+    pthread_mutex_lock(&inflate_lock);
+    while (!slot->full) pthread_cond_wait(&inflate_filled, &inflate_lock);
+    pthread_mutex_unlock(&inflate_lock);
+    size_t length = slot->length;
+    if (!length) return 0;
+
+    char *data = input_block;
+    size_t capacity = input_block_size;
+    input_block = slot->data;
+    input_block_size = slot->capacity;
+    slot->data = data;
+    slot->capacity = capacity;
+
+    pthread_mutex_lock(&inflate_lock);
+    slot->full = 0;
+    pthread_cond_broadcast(&inflate_emptied);
+    pthread_mutex_unlock(&inflate_lock);
+    inflate_next++;
+    return length;
+}
+
+// One read into input_block for the block path. Returns how many bytes it
+// got, which is 0 at the end of the input.
+size_t read_input_block(void) {
+    if (input_compression) return take_inflated_block();
+    if (input_magic_length) return read_magic(input_block);
+    for (;;) {
+        uint64_t started = stats_begin(STATS_READ);
+        ssize_t got = read(fileno(input_file), input_block, input_block_size);
+        stats_end(STATS_READ, started, got > 0 ? got : 0);
+        if (got > 0 && no_cache_pollution)
+            drop_consumed_input(input_position += got);
+        if (got >= 0) return got;
+        if (errno != EINTR) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+    }
+}
+
+// --max-line-memory caps how much of one line the block path keeps in
+// memory. A line that grows past it is moved out to an anonymous temporary
+// file as it arrives. Once its end turns up, the file is read back from the
+// end a block at a time, and each block is reversed on its way out; in --utf8
+// mode the blocks are cut where a character is sure to start. A block with no
+// such place in it (a single cluster longer than the block) is read again
+// twice as big, so a cluster is never split, at the cost of holding the whole
+// cluster in memory. Lines under the cap never get anywhere near this.
+size_t max_line_memory = 0;
+
+FILE *long_line_file = NULL;
+char *long_line_block = NULL;
+size_t long_line_block_size = 0;
+off_t long_line_length = 0;
+_Bool long_line_active = 0;
+
+void append_long_line(const char *data, size_t length) {
+    while (length) {
+        ssize_t written = pwrite(fileno(long_line_file), data, length,
+                                 long_line_length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            fprintf(stderr, "Error writing temporary file: %s\n",
+                    strerror(errno));
+            EXIT_ERR;
+        }
+        data += written;
+        length -= written;
+        long_line_length += written;
+    }
+}
+
+void read_long_line(char *buffer, size_t length, off_t offset) {
+    while (length) {
+        ssize_t got = pread(fileno(long_line_file), buffer, length, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            fprintf(stderr, "Error reading temporary file: %s\n",
+                    strerror(errno));
+            EXIT_ERR;
+        }
+        buffer += got;
+        length -= got;
+        offset += got;
+    }
+}
+
+void start_long_line(const char *data, size_t length) {
+    if (!long_line_file) {
+        long_line_file = tmpfile();
+        if (!long_line_file) {
+            fprintf(stderr, "Error creating temporary file: %s\n",
+                    strerror(errno));
+            EXIT_ERR;
+        }
+        long_line_block = take_buffer(DEFAULT_INPUT_BLOCK_SIZE,
+                                      &long_line_block_size);
+    }
+    long_line_active = 1;
+    long_line_length = 0;
+    append_long_line(data, length);
+}
+
+// head is the rest of the line up to and including its delimiter, or nothing
+// if the input ended first. All of it but the terminator goes into the file,
+// so the whole line can be reversed out of there in one go. The file can end
+// in the '\r' of a CRLF that head only finishes. Returns 0, or whatever
+// nonzero value emit stopped it with.
+int finish_long_line(const char *head, size_t length, reverse_emit_fn emit,
+                     void *user) {
+    char terminator[2];
+    size_t kept = reverse_terminator_length(&reverser, head, length);
+    append_long_line(head, length - kept);
+    if (kept) memcpy(terminator, head + length - kept, kept);
+
+    if (length == 1 && kept == 1 && options.keep_crlf && long_line_length) {
+        char last;
+        read_long_line(&last, 1, long_line_length - 1);
+        if (last == '\r') {
+            terminator[0] = '\r';
+            terminator[1] = head[0];
+            kept = 2;
+            long_line_length--;
+        }
+    }
+
+    off_t end = long_line_length;
+    while (end > 0) {
+        size_t piece = long_line_block_size;
+        if (end < (off_t)piece) piece = end;
+        off_t start = end - piece;
+        read_long_line(long_line_block, piece, start);
+
+        size_t cut = 0;
+        if (start) cut = reverse_unit_boundary(&reverser, long_line_block,
+                                               piece, 0);
+        if (cut == piece) {
+            size_t size = 2 * long_line_block_size;
+            char *grown = take_buffer(size, &size);
+            give_buffer(long_line_block, long_line_block_size);
+            long_line_block = grown;
+            long_line_block_size = size;
+            continue;
+        }
+
+        reverse_text(&reverser, long_line_block + cut, long_line_block + cut,
+                     piece - cut);
+        int status = emit(user, long_line_block + cut, piece - cut);
+        if (status) return status;
+        end = start + cut;
+    }
+    int status = kept ? emit(user, terminator, kept) : 0;
+
+    long_line_active = 0;
+    if (ftruncate(fileno(long_line_file), 0) != 0) {
+        fprintf(stderr, "Error truncating temporary file: %s\n",
+                strerror(errno));
+        EXIT_ERR;
+    }
+    return status;
+}
+
+// A push or finish that didn't go through: status is -1 with errno set, or
+// the nonzero value the emit callback stopped it with.
+void stream_stopped(int status) {
+    if (status == -1)
+        fprintf(stderr, "Error reversing input: %s\n", strerror(errno));
+    else
+        fprintf(stderr, "Error reversing input: output stopped with %d\n",
+                status);
+    EXIT_ERR;
+}
+
+// Pushes a block through the streaming stage. libreverse never allocates, so
+// when a line outgrows the spill, the push is refused untouched; the spill is
+// doubled here and the same block pushed again. Once the spill is as big as
+// --max-line-memory allows, the line goes to the temporary file instead:
+// either the one the spill is holding, or if it's empty, the unfinished line
+// at the end of this block, after the whole ones before it have been pushed.
+void push_block_pieces(char *block, size_t length, reverse_emit_fn emit,
+                       void *user) {
+    for (;;) {
+        if (long_line_active) {
+            char *end = memchr(block, options.delimiter, length);
+            if (!end) {
+                append_long_line(block, length);
+                return;
+            }
+            size_t head = end - block + 1;
+            int status = finish_long_line(block, head, emit, user);
+            if (status) stream_stopped(status);
+            block += head;
+            length -= head;
+        }
+
+        int status = reverse_push(&reverser, block, length, emit, user);
+        if (status == 0) return;
+        if (status != -1 || errno != ENOBUFS) stream_stopped(status);
+
+        if (max_line_memory && input_spill_size >= max_line_memory) {
+            char *held;
+            size_t held_length = reverse_drain_spill(&reverser, &held);
+            if (held_length) {
+                start_long_line(held, held_length);
+                continue;
+            }
+
+            char *last = memrchr(block, options.delimiter, length);
+            size_t whole = last ? (size_t)(last - block) + 1 : 0;
+            if (whole) {
+                status = reverse_push(&reverser, block, whole, emit, user);
+                if (status) stream_stopped(status);
+            }
+            start_long_line(block + whole, length - whole);
+            return;
+        }
+
+        size_t size = input_spill_size ? 2 * input_spill_size
+                                       : DEFAULT_INPUT_BLOCK_SIZE;
+        if (max_line_memory && size > max_line_memory) size = max_line_memory;
+        char *spill = take_buffer(size, &size);
+        reverse_set_spill(&reverser, spill, size);
+        give_buffer(input_spill, input_spill_size);
+        input_spill = spill;
+        input_spill_size = size;
+    }
+}
+
+// A block is one batch as far as --stats is concerned.
+void push_block(char *block, size_t length, reverse_emit_fn emit, void *user) {
+    uint64_t started = stats_begin_batch(block, length, 1);
+    if (verifying) verify_add(&verify_input, block, length);
+    push_block_pieces(block, length, emit, user);
+    stats_end_batch(started, length);
+}
+
+// Ends the stream, with a last line that has no delimiter.
+void finish_stream(reverse_emit_fn emit, void *user) {
+    stats_finish_lines();
+    int status = long_line_active ? finish_long_line(NULL, 0, emit, user)
+                                  : reverse_finish(&reverser, emit, user);
+    if (status) stream_stopped(status);
+}
+
+// The emit callback for the block path. Nothing is ever refused; a failing
+// write exits from inside output_bytes().
+int output_stream(void *unused, const char *data, size_t length) {
+    (void)unused;
+    output_bytes(data, length);
+    return 0;
+}
+
+// Maps the input when it's a regular file. Anything else (pipes, terminals,
+// character devices) or a failed mmap leaves input_map unset, and main() falls
+// back to the block path. Empty files can't be mapped, but they also have no
+// lines, so the fallback handles them for free. For --in-place the mapping
+// is shared and writable, so changes land in the file itself. With --range
+// the whole file is still mapped, but only the range is the input region.
+_Bool map_input(void) {
+    struct stat info;
+    if (input_map) return 1;
+    if (fstat(fileno(input_file), &info) != 0) return 0;
+    if (!S_ISREG(info.st_mode) || info.st_size == 0) return 0;
+    if (input_compression) return 0;
+
+    int protection = in_place ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = in_place ? MAP_SHARED : MAP_PRIVATE;
+    void *map = mmap(NULL, info.st_size, protection, flags,
+                     fileno(input_file), 0);
+    if (map == MAP_FAILED) return 0;
+
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    input_map = input_region = map;
+    input_map_size = input_region_size = info.st_size;
+    if (range_given) {
+        input_region = input_map + range_start;
+        input_region_size = range_end - range_start;
+    }
+    stats_count(STATS_READ, input_region_size);
+    return 1;
+}
+
+// Finds where the --range or --shard falls once both files are open, and
+// points the descriptors at it, so the paths that read and write in order
+// need to know nothing about it. The other paths are turned off: io_uring
+// reads and writes from offset 0, and O_DIRECT can't start mid-page.
+void prepare_range(void) {
+    struct stat info;
+    int in = fileno(input_file);
+    int out = fileno(output_file);
+    if (input_compression || fstat(in, &info) != 0
+        || !S_ISREG(info.st_mode)) {
+        fprintf(stderr, "--range and --shard need an uncompressed regular "
+                "input file\n");
+        EXIT_ERR;
+    }
+
+    size_t size = info.st_size;
+    if (shard_count) {
+        range_first = shard_offset(size, shard_index - 1, shard_count);
+        range_last = shard_offset(size, shard_index, shard_count);
+    }
+    range_start = snap_to_line(in, range_first, size);
+    range_end = snap_to_line(in, range_last, size);
+
+    if (fstat(out, &info) != 0 || !S_ISREG(info.st_mode)) part_output = 1;
+    if (!part_output && output_compression) {
+        fprintf(stderr, "A shared output file can't be compressed; "
+                "use --part\n");
+        EXIT_ERR;
+    }
+    part_offset = part_output ? range_start : 0;
+    use_io_uring = 0;
+    use_direct_io = 0;
+
+    if (lseek(in, range_start, SEEK_SET) < 0
+        || (!part_output && lseek(out, range_start, SEEK_SET) < 0)
+        || (!part_output && ftruncate(out, size) != 0)) {
+        fprintf(stderr, "Error positioning files: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+    if (range_end > range_start && !map_input()) {
+        fprintf(stderr, "Could not map the input\n");
+        EXIT_ERR;
+    }
+}
+
+// The io_uring backend. The synchronous paths read, reverse and write one
+// after another, so the disk waits on the CPU and the CPU waits on the disk.
+// Here URING_DEPTH blocks of chunk_size bytes are in flight at once: while one
+// block is being reversed, the reads for the next few and the writes for the
+// last few are all with the kernel.
+//
+// There's no liburing in the build, so the ring is set up with the raw system
+// calls. Only the parts needed here are wrapped: one submission at a time, and
+// a wait that handles every completion that's arrived.
+#ifdef HAVE_IO_URING
+#define URING_DEPTH 4
+
+struct uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+};
+
+// Each slot owns one input block and the output buffer its reversal goes
+// into. Reads land in input at input_offset; a short read is resubmitted for
+// the remainder until input_length reaches input_wanted. The block is pushed
+// through the streaming stage, and output_length bytes of what comes out have
+// been collected in output.
+struct uring_slot {
+    char *input;
+    size_t input_capacity;
+    size_t input_length;
+    size_t input_wanted;
+    off_t input_offset;
+    struct iovec read_vec;
+    _Bool reading;
+
+    char *output;
+    size_t output_length;
+    size_t output_capacity;
+    off_t output_offset;
+    struct iovec write_vec;
+    _Bool writing;
+};
+
+struct uring ring = { .fd = -1 };
+struct uring_slot uring_slots[URING_DEPTH];
+
+// Lines keep their length, so the output is written at the same offsets the
+// input was read from. This is how much of it has been emitted so far.
+off_t uring_output_offset = 0;
+
+_Bool uring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring.fd = syscall(__NR_io_uring_setup, 2 * URING_DEPTH, &params);
+    if (ring.fd < 0) return 0;
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size)
+            ring.sq_ring_size = ring.cq_ring_size;
+        ring.cq_ring_size = 0;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) return 0;
+
+    ring.cq_ring = ring.sq_ring;
+    if (ring.cq_ring_size) {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) return 0;
+    }
+
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) return 0;
+
+    char *sq = ring.sq_ring;
+    char *cq = ring.cq_ring;
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+// readv/writev rather than the plain read/write opcodes, so this works on
+// every kernel that has io_uring at all. user_data is the slot index times
+// two, plus one for writes.
+void uring_submit(int opcode, int fd, struct iovec *vec, off_t offset,
+                  unsigned long long user_data) {
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)vec;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    stats_count(opcode == IORING_OP_WRITEV ? STATS_WRITE : STATS_READ, 0);
+
+    while (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        fprintf(stderr, "io_uring submit failed: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+}
+
+// An O_DIRECT read has to ask for whole blocks, even for the end of the file.
+// It comes back short there anyway, so the input buffer is rounded up to hold
+// the block it asks for.
+void uring_read_rest(struct uring_slot *slot, size_t index) {
+    size_t wanted = slot->input_wanted - slot->input_length;
+    if (direct_input)
+        wanted = (wanted + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT
+                 * BUFFER_ALIGNMENT;
+    slot->read_vec.iov_base = slot->input + slot->input_length;
+    slot->read_vec.iov_len = wanted;
+    slot->reading = 1;
+    uring_submit(IORING_OP_READV, fileno(input_file), &slot->read_vec,
+                 slot->input_offset + slot->input_length, 2 * index);
+}
+
+void uring_start_read(size_t index, off_t offset, size_t file_size) {
+    struct uring_slot *slot = &uring_slots[index];
+    slot->input_offset = offset;
+    slot->input_length = 0;
+    slot->input_wanted = file_size - offset < chunk_size ? file_size - offset
+                                                         : chunk_size;
+    uring_read_rest(slot, index);
+}
+
+void uring_start_write(size_t index, size_t length, off_t offset) {
+    struct uring_slot *slot = &uring_slots[index];
+    slot->output_offset = offset;
+    slot->write_vec.iov_base = slot->output;
+    slot->write_vec.iov_len = length;
+    slot->writing = 1;
+    uring_submit(IORING_OP_WRITEV, fileno(output_file), &slot->write_vec,
+                 offset, 2 * index + 1);
+}
+
+void uring_complete(struct io_uring_cqe *cqe) {
+    struct uring_slot *slot = &uring_slots[cqe->user_data / 2];
+    _Bool is_write = cqe->user_data & 1;
+
+    if (cqe->res < 0) {
+        fprintf(stderr, "Error %s: %s\n", is_write ? "writing output"
+                                                   : "reading input",
+                strerror(-cqe->res));
+        EXIT_ERR;
+    }
+
+    if (collect_stats)
+        stats_add(&stage_stats[is_write ? STATS_WRITE : STATS_READ].bytes,
+                  cqe->res);
+    if (!is_write) {
+        slot->input_length += cqe->res;
+        if (cqe->res == 0) slot->input_wanted = slot->input_length;
+        if (slot->input_length < slot->input_wanted)
+            uring_read_rest(slot, cqe->user_data / 2);
+        else
+            slot->reading = 0;
+        return;
+    }
+
+    slot->write_vec.iov_base = (char *)slot->write_vec.iov_base + cqe->res;
+    slot->write_vec.iov_len -= cqe->res;
+    slot->output_offset += cqe->res;
+    if (slot->write_vec.iov_len && cqe->res > 0)
+        uring_submit(IORING_OP_WRITEV, fileno(output_file), &slot->write_vec,
+                     slot->output_offset, cqe->user_data);
+    else if (slot->write_vec.iov_len) {
+        fprintf(stderr, "Error writing output: no progress\n");
+        EXIT_ERR;
+    } else
+        slot->writing = 0;
+}
+
+// Blocks until at least one completion has arrived, then handles all of
+// them.
+void uring_wait(void) {
+    unsigned head = *ring.cq_head;
+    while (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        stats_add(&stats_other_syscalls, 1);
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            fprintf(stderr, "io_uring wait failed: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+    }
+
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        uring_complete(&cqe);
+    }
+}
+
+// The emit callback for the io_uring path. The input block is read into
+// again while this block's write is in flight, so the output has to be
+// collected in the slot's own buffer.
+int uring_emit(void *user, const char *data, size_t length) {
+    struct uring_slot *slot = user;
+    size_t needed = slot->output_length + length;
+    if (needed > slot->output_capacity) {
+        size_t capacity = 2 * slot->output_capacity;
+        if (capacity < needed) capacity = needed;
+        char *grown = take_buffer(capacity, &capacity);
+        memcpy(grown, slot->output, slot->output_length);
+        give_buffer(slot->output, slot->output_capacity);
+        slot->output = grown;
+        slot->output_capacity = capacity;
+    }
+    memcpy(slot->output + slot->output_length, data, length);
+    slot->output_length = needed;
+    return 0;
+}
+
+// Reverses one block that has finished reading into its slot's output buffer.
+// Lines that start and end inside the block are reversed where they are, and
+// the streaming stage takes care of a line that started in an earlier block
+// and of the unfinished one at the end. Returns how many bytes of output
+// there are to write, starting at *output_offset.
+size_t reverse_uring_block(size_t index, _Bool final, off_t *output_offset) {
+    struct uring_slot *slot = &uring_slots[index];
+    slot->output_length = 0;
+
+    push_block(slot->input, slot->input_length, uring_emit, slot);
+    if (final) finish_stream(uring_emit, slot);
+    if (verifying)
+        verify_add(&verify_output, slot->output, slot->output_length);
+
+    *output_offset = uring_output_offset;
+    uring_output_offset += slot->output_length;
+    return slot->output_length;
+}
+
+// Returns 0 without having written anything if the backend can't be used, so
+// main() can carry on with the synchronous paths.
+_Bool reverse_with_io_uring(void) {
+    struct stat input_info, output_info;
+    if (fstat(fileno(input_file), &input_info) != 0
+        || fstat(fileno(output_file), &output_info) != 0
+        || !S_ISREG(input_info.st_mode) || !S_ISREG(output_info.st_mode))
+        return 0;
+    if (!uring_setup()) return 0;
+
+    size_t file_size = input_info.st_size;
+    size_t block_count = (file_size + chunk_size - 1) / chunk_size;
+
+    for (size_t i = 0; i < URING_DEPTH; i++) {
+        uring_slots[i].input = take_buffer(chunk_size,
+                                           &uring_slots[i].input_capacity);
+    }
+    if (use_direct_io && chunk_size % BUFFER_ALIGNMENT == 0)
+        direct_input = set_direct(fileno(input_file), 1);
+    for (size_t block = 0; block < block_count && block < URING_DEPTH; block++)
+        uring_start_read(block, block * chunk_size, file_size);
+
+    for (size_t block = 0; block < block_count; block++) {
+        size_t index = block % URING_DEPTH;
+        struct uring_slot *slot = &uring_slots[index];
+        while (slot->reading || slot->writing) uring_wait();
+
+        off_t output_offset;
+        size_t output_length =
+            reverse_uring_block(index, block + 1 == block_count,
+                                &output_offset);
+        if (output_length) uring_start_write(index, output_length,
+                                             output_offset);
+
+        if (block + URING_DEPTH < block_count)
+            uring_start_read(index, (block + URING_DEPTH) * chunk_size,
+                             file_size);
+    }
+
+    for (size_t i = 0; i < URING_DEPTH; i++)
+        while (uring_slots[i].writing) uring_wait();
+    return 1;
+}
+
+void release_io_uring(void) {
+    if (ring.fd < 0) return;
+    for (size_t i = 0; i < URING_DEPTH; i++) {
+        give_buffer(uring_slots[i].input, uring_slots[i].input_capacity);
+        give_buffer(uring_slots[i].output, uring_slots[i].output_capacity);
+    }
+    if (ring.sqes && ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring_size && ring.cq_ring && ring.cq_ring != MAP_FAILED)
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+}
+#endif
+
+// Stage times are scaled up from the calls that were timed. A stage that
+// had calls but none timed has no time to show, and says so with a negative.
+double stats_seconds(enum stats_stage stage) {
+    struct stage_stats *counted = &stage_stats[stage];
+    if (!counted->timed_calls) return counted->calls ? -1 : 0;
+    return counted->nanoseconds / 1e9 * counted->calls / counted->timed_calls;
+}
+
+// Only nodes that had workers get a line. The rate is per worker, over the
+// batches that were timed, the same as the reverse stage's seconds.
+void print_node_stats(void) {
+    _Bool first = 1;
+    for (int i = 0; i < stats_node_count; i++) {
+        struct node_stats *node = &node_stats[i];
+        if (!node->workers) continue;
+        double seconds = node->timed_bytes ? node->nanoseconds / 1e9 : -1;
+        double rate = seconds > 0 ? node->timed_bytes / seconds / 1e6 : -1;
+        if (stats_json) {
+            fprintf(stderr, "%s{\"node\": %d, \"workers\": %" PRIu64
+                    ", \"bytes\": %" PRIu64 ", \"mb_per_second\": ",
+                    first ? ", \"nodes\": [" : ", ", node->id,
+                    node->workers, node->bytes);
+            if (rate < 0) fprintf(stderr, "null}");
+            else fprintf(stderr, "%.1f}", rate);
+        } else {
+            fprintf(stderr, "node %-5d %" PRIu64 " workers, %" PRIu64
+                    " bytes", node->id, node->workers, node->bytes);
+            if (rate < 0) fprintf(stderr, ", untimed\n");
+            else fprintf(stderr, ", %.1f MB/s a worker\n", rate);
+        }
+        first = 0;
+    }
+    if (stats_json && !first) fprintf(stderr, "]");
+}
+
+void print_stats(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - stats_started.tv_sec)
+                     + (now.tv_nsec - stats_started.tv_nsec) / 1e9;
+
+    uint64_t reversed = stage_stats[STATS_REVERSE].bytes;
+    _Bool estimated = stats_counted_bytes < reversed && stats_counted_bytes;
+    uint64_t lines = estimated ? (double)stats_lines * reversed
+                                 / stats_counted_bytes
+                               : stats_lines;
+    uint64_t syscalls = stage_stats[STATS_READ].calls
+                        + stage_stats[STATS_WRITE].calls
+                        + stats_other_syscalls;
+
+    if (stats_json) {
+        fprintf(stderr, "{\"elapsed_seconds\": %.6f, \"sample\": %" PRIu64
+                ", \"stages\": {", elapsed, stats_sample);
+        for (int stage = 0; stage < STATS_STAGES; stage++) {
+            double seconds = stats_seconds(stage);
+            fprintf(stderr, "%s\"%s\": {\"calls\": %" PRIu64 ", \"bytes\": %"
+                    PRIu64 ", \"seconds\": ", stage ? ", " : "",
+                    stats_stage_names[stage], stage_stats[stage].calls,
+                    stage_stats[stage].bytes);
+            if (seconds < 0) fprintf(stderr, "null}");
+            else fprintf(stderr, "%.6f}", seconds);
+        }
+        fprintf(stderr, "}, \"lines\": %" PRIu64 ", \"lines_estimated\": %s, "
+                "\"longest_line\": %" PRIu64 ", \"buffers_taken\": %" PRIu64
+                ", \"buffers_mapped\": %" PRIu64 ", \"syscalls\": %" PRIu64,
+                lines, estimated ? "true" : "false",
+                stats_longest_line, stats_buffers_taken, stats_buffers_mapped,
+                syscalls);
+        print_node_stats();
+        fprintf(stderr, "}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-10s %12s %16s %10s\n", "stage", "calls", "bytes",
+            "seconds");
+    for (int stage = 0; stage < STATS_STAGES; stage++) {
+        double seconds = stats_seconds(stage);
+        fprintf(stderr, "%-10s %12" PRIu64 " %16" PRIu64, stats_stage_names[stage],
+                stage_stats[stage].calls, stage_stats[stage].bytes);
+        if (seconds < 0) fprintf(stderr, " %10s\n", "untimed");
+        else fprintf(stderr, " %10.3f\n", seconds);
+    }
+    fprintf(stderr, "lines:    %" PRIu64 "%s, the longest %" PRIu64
+            " bytes%s\n", lines, estimated ? " (estimated)" : "",
+            stats_longest_line, estimated ? " or more" : "");
+    fprintf(stderr, "buffers:  %" PRIu64 " taken, %" PRIu64 " newly mapped\n",
+            stats_buffers_taken, stats_buffers_mapped);
+    fprintf(stderr, "syscalls: %" PRIu64 "\n", syscalls);
+    print_node_stats();
+    fprintf(stderr, "elapsed:  %.3f seconds", elapsed);
+    if (stats_sample > 1)
+        fprintf(stderr, ", one call in %" PRIu64 " sampled", stats_sample);
+    fprintf(stderr, "\n");
+}
+
+// --stdio is the FILE * loop this program started out as, kept for systems
+// where the descriptor paths can't be had or don't pay, and brought up to
+// date. A line at a time comes in through getdelim() and goes out through
+// fwrite(), both on buffers as big as -b rather than stdio's few kilobytes.
+// Only this thread ever touches the two streams, so their locks are turned
+// off where <stdio_ext.h> allows it, and otherwise taken once for the whole
+// run, so none of the per-call locking is left. The line is reversed by
+// libreverse like everywhere else. getdelim() grows its buffer to the longest
+// line, so --max-line-memory, like anything that needs the descriptors to
+// itself (compressed files, a pipe whose first bytes detection has already
+// read), has the block path take over instead.
+_Bool use_stdio = 0;
+char *stdio_input_buffer = NULL;
+char *stdio_output_buffer = NULL;
+size_t stdio_input_buffer_size = 0;
+size_t stdio_output_buffer_size = 0;
+
+_Bool stdio_applies(void) {
+    return !input_compression && !output_compression && !input_magic_length
+           && !max_line_memory;
+}
+
+void take_stdio_locks(void) {
+#ifdef HAVE_STDIO_EXT
+    __fsetlocking(input_file, FSETLOCKING_BYCALLER);
+    __fsetlocking(output_file, FSETLOCKING_BYCALLER);
+#else
+    flockfile(input_file);
+    flockfile(output_file);
+#endif
+}
+
+void release_stdio_locks(void) {
+#ifndef HAVE_STDIO_EXT
+    funlockfile(output_file);
+    funlockfile(input_file);
+#endif
+}
+
+void reverse_with_stdio(void) {
+    stdio_input_buffer = take_buffer(output_buffer_size,
+                                     &stdio_input_buffer_size);
+    stdio_output_buffer = take_buffer(output_buffer_size,
+                                      &stdio_output_buffer_size);
+    setvbuf(input_file, stdio_input_buffer, _IOFBF, stdio_input_buffer_size);
+    setvbuf(output_file, stdio_output_buffer, _IOFBF,
+            stdio_output_buffer_size);
+    take_stdio_locks();
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getdelim(&line, &line_size, options.delimiter,
+                              input_file)) != -1) {
+        uint64_t started = stats_begin_batch(line, length, 0);
+        if (verifying) verify_add(&verify_input, line, length);
+        reverse_record(&reverser, line, line, length);
+        if (verifying) verify_add(&verify_output, line, length);
+        stats_end_batch(started, length);
+        if (fwrite(line, 1, length, output_file) != (size_t)length) break;
+    }
+    free(line);
+    _Bool failed = ferror(input_file) || ferror(output_file)
+                   || fflush(output_file) != 0;
+    release_stdio_locks();
+    if (failed) {
+        fprintf(stderr, "Error copying through stdio: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+}
+
+// Writes out the end of a compressed output; see compress_output().
+void finish_output(void) {
+    if (output_compression) {
+        compress_output(NULL, 0, 1);
+        output_compression = COMPRESSION_NONE;
+    }
+    if (verifying) report_verify();
+}
+
+void cleanup(void) {
+    if (collect_stats) print_stats();
+    if (no_cache_pollution) drop_cached_files();
+    if (input_file) fclose(input_file);
+    if (output_file) fclose(output_file);
+    give_buffer(stdio_input_buffer, stdio_input_buffer_size);
+    give_buffer(stdio_output_buffer, stdio_output_buffer_size);
+    give_buffer(output_buffer, output_buffer_capacity);
+    give_buffer(output_spare, output_buffer_capacity);
+    give_buffer(input_block, input_block_size);
+    give_buffer(input_spill, input_spill_size);
+    give_buffer(text_scratch, text_scratch_size);
+    give_buffer(long_line_block, long_line_block_size);
+    if (long_line_file) fclose(long_line_file);
+
+    // A failing write can bring us here while workers are still reading the
+    // mapping. The process is about to exit anyway, so leave it mapped.
+    if (input_map && !workers_running) munmap(input_map, input_map_size);
+    if (slots && !workers_running) {
+        for (size_t i = 0; i < slot_count; i++)
+            give_buffer(slots[i].buffer, slots[i].capacity);
+        free(slots);
+    }
+#ifdef HAVE_IO_URING
+    release_io_uring();
+#endif
+    if (!workers_running) release_buffer_pool();
+}
+
+enum compression compression_for_magic(const char *data, size_t length) {
+    if (length >= 2 && memcmp(data, "\x1f\x8b", 2) == 0)
+        return COMPRESSION_GZIP;
+    if (length >= 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+// Looks for gzip's or zstd's magic number at the start of the input. Only as
+// much is read as could still turn out to be one, so a terminal isn't kept
+// waiting for bytes nobody has typed yet. A read error is left for whoever
+// reads next to find.
+void detect_input_compression(int fd) {
+    size_t length = 0, wanted = 1;
+    while (length < wanted) {
+        ssize_t got = read(fd, input_magic + length, wanted - length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        length += got;
+        if (length == 1 && input_magic[0] == '\x1f') wanted = 2;
+        if (length == 1 && input_magic[0] == '\x28') wanted = 4;
+    }
+
+    input_compression = compression_for_magic(input_magic, length);
+
+    if (length && lseek(fd, -(off_t)length, SEEK_CUR) >= 0) length = 0;
+    input_magic_length = length;
+}
+
+enum compression compression_for_name(const char *filename) {
+    size_t length = strlen(filename);
+    if (length > 3 && strcmp(filename + length - 3, ".gz") == 0)
+        return COMPRESSION_GZIP;
+    if (length > 4 && strcmp(filename + length - 4, ".zst") == 0)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+// This function is neat because it emerged as a result of refactoring.
+// In the rough draft I just had it in the main function to open the input file,
+// check for success, then open the output file and check. If the output failed
+// to open, I made sure to close the input file. Thus they were different enough
+// that I wondered whether it'd even be worthwhile to try and combine them into
+// a single function, despite how similar they were. After creating the above
+// cleanup function for a different reason, I found I was now able to write a
+// generic method easily. I made sure ptr was the first argument - by looking at
+// how this function is used in main you can see how this prevents this generic
+// function from making the code less readable.
+// It used to be called open(), which clashes with open(2) as soon as fcntl.h
+// is included. "-" means stdin or stdout, depending on the mode. Opening is
+// also where compression gets noticed: an input's by its first few bytes, an
+// output's by its name.
+void open_file(FILE **ptr, char *filename, char *mode) {
+    if (strcmp(filename, "-") == 0)
+        *ptr = mode[0] == 'r' ? stdin : stdout;
+    else
+        *ptr = fopen(filename, mode);
+    if (!*ptr) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        EXIT_ERR;
+    }
+
+    if (strcmp(mode, "r") == 0) detect_input_compression(fileno(*ptr));
+    if (strcmp(mode, "w") == 0)
+        output_compression = compression_for_name(filename);
+}
+
+// The shared out-file of --range is made if it isn't there yet, but never
+// emptied, since other shards may already be writing into it.
+void open_shared_output(char *filename) {
+    if (strcmp(filename, "-") == 0) {
+        open_file(&output_file, filename, "w");
+        return;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT, 0666);
+    output_file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!output_file) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        EXIT_ERR;
+    }
+    output_compression = compression_for_name(filename);
+}
+
+// Sets up --no-cache-pollution once both files are open. Only regular files
+// have cached pages to spare; the tracking starts wherever the descriptors
+// already are, in case the shell handed us an offset.
+void prepare_cache_hints(void) {
+#ifdef __linux__
+    struct stat info;
+    int in = fileno(input_file);
+    int out = fileno(output_file);
+    if (!no_cache_pollution) return;
+
+    off_t position = lseek(in, 0, SEEK_CUR);
+    if (fstat(in, &info) == 0 && S_ISREG(info.st_mode) && position >= 0) {
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(in, position, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+        input_position = position;
+        input_dropped = position & ~(off_t)(CACHE_WINDOW - 1);
+        drop_input = 1;
+    }
+
+    position = lseek(out, 0, SEEK_CUR);
+    if (fstat(out, &info) == 0 && S_ISREG(info.st_mode) && position >= 0) {
+        output_position = position;
+        output_started = output_dropped = position & ~(off_t)(CACHE_WINDOW - 1);
+        drop_output = 1;
+    }
+#endif
+}
+
+_Bool compression_built_in(enum compression compression) {
+#ifdef HAVE_ZLIB
+    if (compression == COMPRESSION_GZIP) return 1;
+#endif
+#ifdef HAVE_ZSTD
+    if (compression == COMPRESSION_ZSTD) return 1;
+#endif
+    return compression == COMPRESSION_NONE;
+}
+
+// Sets up whichever ends are compressed, and starts the decompressing thread.
+// A compressed input can't be mapped, and a compressed output can't be
+// written at offsets, spliced or written with O_DIRECT. io_uring can't deal
+// with either, so it's turned off as well.
+void prepare_compression(void) {
+    if (!compression_built_in(input_compression)) {
+        fprintf(stderr, "The input is %s compressed; that needs a build with "
+                "%s\n", input_compression == COMPRESSION_GZIP ? "gzip" : "zstd",
+                input_compression == COMPRESSION_GZIP ? "-DHAVE_ZLIB -lz"
+                                                      : "-DHAVE_ZSTD -lzstd");
+        EXIT_ERR;
+    }
+    if (!compression_built_in(output_compression)) {
+        fprintf(stderr, "Writing %s needs a build with %s\n",
+                output_compression == COMPRESSION_GZIP ? ".gz" : ".zst",
+                output_compression == COMPRESSION_GZIP ? "-DHAVE_ZLIB -lz"
+                                                       : "-DHAVE_ZSTD -lzstd");
+        EXIT_ERR;
+    }
+    if (input_compression || output_compression) use_io_uring = 0;
+
+#ifdef HAVE_ZLIB
+    if (input_compression == COMPRESSION_GZIP
+        && inflateInit2(&inflater, 15 + 16) != Z_OK) {
+        fprintf(stderr, "Can't start decompressing: %s\n", inflater.msg);
+        EXIT_ERR;
+    }
+    if (output_compression == COMPRESSION_GZIP
+        && deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                        8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Can't start compressing: %s\n", deflater.msg);
+        EXIT_ERR;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (input_compression == COMPRESSION_ZSTD)
+        zstd_decompressor = ZSTD_createDCtx();
+    if (output_compression == COMPRESSION_ZSTD) {
+        zstd_compressor = ZSTD_createCCtx();
+        long threads = thread_count > 1 ? thread_count
+                                        : sysconf(_SC_NPROCESSORS_ONLN);
+        if (zstd_compressor && threads > 1)
+            ZSTD_CCtx_setParameter(zstd_compressor, ZSTD_c_nbWorkers, threads);
+    }
+    if ((input_compression == COMPRESSION_ZSTD && !zstd_decompressor)
+        || (output_compression == COMPRESSION_ZSTD && !zstd_compressor)) {
+        fprintf(stderr, "Out of memory\n");
+        EXIT_ERR;
+    }
+#endif
+
+    if (output_compression) {
+        use_pwrite = 0;
+        use_direct_io = 0;
+        compressed_output = take_buffer(output_buffer_size,
+                                        &compressed_output_size);
+        if (compressed_output_size > COMPRESSION_PIECE)
+            compressed_output_size = COMPRESSION_PIECE;
+    }
+
+    if (!input_compression) return;
+    compressed_input = take_buffer(DEFAULT_INPUT_BLOCK_SIZE,
+                                   &compressed_input_size);
+    for (size_t i = 0; i < INFLATE_DEPTH; i++) {
+        inflate_slots[i].data = take_buffer(DEFAULT_INPUT_BLOCK_SIZE,
+                                            &inflate_slots[i].capacity);
+    }
+    pthread_t thread;
+    workers_running = 1;
+    if (pthread_create(&thread, NULL, inflate_input, NULL) != 0) {
+        fprintf(stderr, "Could not start the decompressing thread\n");
+        EXIT_ERR;
+    }
+    pthread_detach(thread);
+}
+
+void print_usage(char *program) {
+    fprintf(stderr,
+            "Usage: %s [options] [in-file] [out-file]\n"
+            "  (\"-\" for either file means stdin or stdout)\n"
+            "  -b, --buffer-size SIZE  output buffer and chunk size (default 4M; K/M/G)\n"
+            "  -j, --jobs N            reverse regular files on N threads\n"
+            "      --pwrite            with -j, workers write at their own offsets\n"
+            "      --affinity[=nodes|cpus|none]\n"
+            "                          with -j, keep workers and their memory on a\n"
+            "                          NUMA node each (or a CPU each)\n"
+            "      --io-uring          overlap reads, reversal and writes (Linux)\n"
+            "      --stdio             a line at a time through getline() and fwrite()\n"
+            "      --utf8[=graphemes]  reverse characters (or clusters), not bytes\n"
+            "  -d, --delimiter CHAR    end records with CHAR (\\0, \\n, \\t allowed)\n"
+            "      --crlf              keep \\r\\n together at the end of each line\n"
+            "      --tac[=reversed]    put the lines last to first (and reverse them)\n"
+            "  -f, --fields LIST       reverse only these fields (like cut -f)\n"
+            "      --reverse-field-order\n"
+            "                          put each line's fields in the opposite order\n"
+            "  -t, --field-separator CHAR\n"
+            "                          split fields on CHAR (default tab)\n"
+            "      --max-line-memory SIZE\n"
+            "                          keep at most SIZE of a line in memory\n"
+            "      --huge-pages        back the I/O buffers with 2M pages\n"
+            "      --direct            O_DIRECT reads and writes where they fit\n"
+            "      --no-cache-pollution\n"
+            "                          drop the files' pages from the cache as we go\n"
+            "      --stats[=json]      print per-stage counters to stderr at exit\n"
+            "      --stats-sample N    time and scan only one call in N\n"
+            "      --verify            check the output has the input's bytes and\n"
+            "                          lines, and print both sides' CRC32C\n"
+            "   or: %s [options] --range START:END | --shard K/N in-file out-file\n"
+            "      --range START:END   reverse the lines that start in this range\n"
+            "                          of bytes, at the same offsets of out-file\n"
+            "      --shard K/N         the range that's the K-th of N equal shares\n"
+            "      --part              write only the range, from out-file's start\n"
+            "   or: %s --plan N|START:END,... in-file\n"
+            "      --plan              show where each range falls and check that\n"
+            "                          together they cover the file once\n"
+            "   or: %s [options] --in-place file\n"
+            "      --in-place          reverse the lines of a file within itself\n"
+            "   or: %s [options] --batch in-file out-file [in-file out-file...]\n"
+            "   or: %s [options] --batch=MANIFEST\n"
+            "      --batch             reverse many pairs on -j threads; the manifest\n"
+            "                          has one in-file<TAB>out-file per line\n"
+            "   or: %s [options] --serve SOCKET\n"
+            "      --serve SOCKET      reverse what each connection sends and send it\n"
+            "                          back, on -j threads, until killed\n"
+            "   or: %s [options] --bench[=PROFILE,...]\n"
+            "      --bench             time every backend on made-up input\n"
+            "                          (short, json, giant or MIN-MAX line lengths)\n"
+            "      --bench-size SIZE   size of each bench input (default 64M)\n"
+            "      --bench-runs N      timed runs per backend (default 10)\n",
+            program, program, program, program, program, program, program,
+            program);
+}
+
+// An offset is a size that may be zero, with whatever follows it left at
+// *end for the caller.
+_Bool parse_offset(const char *text, char **end, size_t *offset) {
+    errno = 0;
+    unsigned long long value = strtoull(text, end, 10);
+    if (errno || *end == text || *text == '-') return 0;
+
+    switch (**end) {
+    case 'k': case 'K': value <<= 10; (*end)++; break;
+    case 'm': case 'M': value <<= 20; (*end)++; break;
+    case 'g': case 'G': value <<= 30; (*end)++; break;
+    }
+    *offset = value;
+    return 1;
+}
+
+// Sizes are given in bytes with an optional K, M or G suffix. Zero, garbage
+// and trailing junk are all rejected rather than silently turned into
+// something surprising.
+size_t parse_size(const char *text) {
+    char *end;
+    size_t value;
+    if (!parse_offset(text, &end, &value)) return 0;
+    return *end ? 0 : value;
+}
+
+// START:END, or START: for the rest of the file. Either end may have a K, M
+// or G suffix.
+_Bool parse_range(const char *text, size_t *first, size_t *last) {
+    char *end;
+    if (!parse_offset(text, &end, first) || *end++ != ':') return 0;
+    *last = SIZE_MAX;
+    if (*end && (!parse_offset(end, &end, last) || *end)) return 0;
+    return *first <= *last;
+}
+
+// K/N, with K from 1 to N.
+_Bool parse_shard(const char *text) {
+    char *end;
+    shard_index = strtol(text, &end, 10);
+    if (end == text || *end != '/') return 0;
+    text = end + 1;
+    shard_count = strtol(text, &end, 10);
+    return end != text && !*end && shard_count > 0 && shard_index > 0
+           && shard_index <= shard_count;
+}
+
+// A delimiter is a single character, or one of a few escapes for the ones
+// that are awkward to type. An empty argument means NUL, the same as
+// `read -d ''` in the shell.
+_Bool parse_delimiter(const char *text, char *delimiter) {
+    if (text[0] == '\0') { *delimiter = '\0'; return 1; }
+    if (text[1] == '\0') { *delimiter = text[0]; return 1; }
+    if (text[0] != '\\' || text[2] != '\0') return 0;
+
+    switch (text[1]) {
+    case '0': *delimiter = '\0'; return 1;
+    case 'n': *delimiter = '\n'; return 1;
+    case 't': *delimiter = '\t'; return 1;
+    case 'r': *delimiter = '\r'; return 1;
+    case '\\': *delimiter = '\\'; return 1;
+    }
+    return 0;
+}
+
+// A field list is a comma-separated list of field numbers and ranges, N-M,
+// N- or -M, counted from 1 the way cut(1) does.
+_Bool parse_field_list(const char *text) {
+    for (;;) {
+        struct reverse_field_range range = { 1, SIZE_MAX };
+        char *end = (char *)text;
+        if (*text != '-') {
+            if (!isdigit((unsigned char)*text)) return 0;
+            range.first = range.last = strtoull(text, &end, 10);
+        }
+        if (*end == '-') {
+            text = ++end;
+            range.last = SIZE_MAX;
+            if (isdigit((unsigned char)*text))
+                range.last = strtoull(text, &end, 10);
+        }
+        if ((*end != ',' && *end != '\0') || !range.first
+            || range.first > range.last)
+            return 0;
+
+        struct reverse_field_range *grown =
+            realloc(field_ranges, (field_range_count + 1) * sizeof *grown);
+        if (!grown) return 0;
+        field_ranges = grown;
+        field_ranges[field_range_count++] = range;
+        if (!*end) break;
+        text = end + 1;
+    }
+
+    options.field_ranges = field_ranges;
+    options.field_range_count = field_range_count;
+    return 1;
+}
+
+// --bench answers "which path wins on this machine?" without anyone having to
+// write their own scripts. It makes up an input for each profile, runs it
+// through every backend a number of times, and prints how each one did. The
+// runs are the real thing: each is a forked copy of this process that goes
+// on through main() with the bench files as its input and output, exactly as
+// if they'd been named on the command line, along with whatever other
+// options were given. The exception is the baseline, the getline() loop this
+// program started out as, which is kept below to measure everything against.
+//
+// A profile is one of these names, or a range of line lengths as MIN-MAX
+// (K, M and G allowed), with each line's length picked evenly in between:
+//
+//   short   log lines, 40 to 200 bytes
+//   json    long JSON records, 1K to 64K
+//   giant   the whole input as a single line
+//
+// A run is timed from fork to exit, so it includes starting up and mapping
+// the files, the same as a real invocation would. The percentiles are over
+// the runs of one backend. Each backend's first output is checked against
+// libreverse's before any of its numbers are printed.
+#define BENCH_DEFAULT_PROFILES "short,json,giant"
+#define BENCH_DEFAULT_SIZE (64 << 20)
+#define BENCH_MAX_RUNS 1000
+
+_Bool bench_mode = 0;
+const char *bench_profiles = BENCH_DEFAULT_PROFILES;
+size_t bench_size = BENCH_DEFAULT_SIZE;
+long bench_runs = 10;
+long bench_threads = 0;
+
+struct bench_backend {
+    const char *name;
+    _Bool baseline;
+    _Bool pipe_input;
+    _Bool parallel;
+    _Bool pwrite;
+    _Bool io_uring;
+    _Bool stdio;
+};
+
+const struct bench_backend bench_backends[] = {
+    { "baseline (getline)", 1, 0, 0, 0, 0, 0 },
+    { "stdio", 0, 0, 0, 0, 0, 1 },
+    { "block (pipe in)", 0, 1, 0, 0, 0, 0 },
+    { "mmap", 0, 0, 0, 0, 0, 0 },
+    { "mmap -j", 0, 0, 1, 0, 0, 0 },
+    { "mmap -j --pwrite", 0, 0, 1, 1, 0, 0 },
+#ifdef HAVE_IO_URING
+    { "io_uring", 0, 0, 0, 0, 1, 0 },
+#endif
+};
+
+// The bench files are unlinked as soon as they're made, so nothing is left
+// behind however the run ends. Children get them through dup().
+int bench_input = -1;
+int bench_output = -1;
+char *bench_input_map = NULL;
+char *bench_expected = NULL;
+size_t bench_expected_capacity = 0;
+size_t bench_line_count = 0;
+double bench_times[BENCH_MAX_RUNS];
+
+// The original loop, from before any of the paths above existed, with its
+// globals renamed so they stay out of the way. getline() grows the line
+// buffer, reverse_line() swaps a pair of bytes at a time, and fprintf() copies
+// the line out through stdio. It relied on every line ending in a newline and
+// on there being no NULs, which the bench inputs make sure of.
+char *baseline_line_buffer = NULL;
+size_t baseline_line_size = 0;
+
+void baseline_output_line(void) {
+    fprintf(output_file, "%s", baseline_line_buffer);
+}
+
+void baseline_reverse_line(void) {
+    char *left = baseline_line_buffer;
+
+    char *right = left;
+    while (*right != '\n') right++;
+    right--;
+
+    char tmp;
+
+    while (left < right) {
+        tmp = *left; *left = *right; *right = tmp;
+        left++; right--;
+    }
+}
+
+void run_baseline(void) {
+    while (getline(&baseline_line_buffer, &baseline_line_size, input_file) != -1) {
+        baseline_reverse_line();
+        baseline_output_line();
+    }
+    free(baseline_line_buffer);
+}
+
+// The baseline only knows about newlines and bytes.
+_Bool baseline_applies(void) {
+    return options.delimiter == '\n' && !options.keep_crlf
+           && options.text_mode == REVERSE_BYTES && !splitting_fields();
+}
 
-FILE *input_file = NULL;
-FILE *output_file = NULL;
+// A small xorshift generator, so every run of --bench sees the same inputs.
+uint64_t bench_random_state = 0x9e3779b97f4a7c15;
 
-char *input_line_buffer = NULL;
-size_t input_line_size = 0;
-
-// With this function you see one downside in breaking apart main() into
-// separate functions. With everything all in one place, checks for whether the
-// input file was loaded properly can be run once. When lines like this are
-// isolated in their own function, the abstraction can hide potentially
-// dangerous pitfalls, like calling fprintf without initializing all the files.
-// So you either need to include that check in the function itself, and have it
-// run every time its called, or leave a potential landmine for someone to step
-// on.
-// My bias is towards readability, but the tradeoffs between efficiency, safety,
-// and readability can only be determined when working with a real project.
-void output_line(void) {
-    if (input_line_buffer && output_file)
-        fprintf(output_file, "%s", input_line_buffer);
-}
-
-// The heart of this little example. I used pointer arithmetic to keep this
-// particularly concise. It might be a bit too clever though.
-// Note the "while (*right" loop. I have to scan for the end of the line,
-// starting from the beginning, since input_buffer_size is just the size of the
-// allocated buffer, which is the smallest factor of 8 bytes that will fit the
-// line. Scanning from the end of that will mean you're scanning inintialized
-// memory, which is unpredicatble. Spent quite a bit of time figuring that
-// little bug out.
-void reverse_line(void) {
-    char *left = input_line_buffer;
+uint64_t bench_random(void) {
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 7;
+    bench_random_state ^= bench_random_state << 17;
+    return bench_random_state;
+}
 
-    char *right = left;
-    while (*right != '\n') right++;
-    right--;
+// Turns one profile from the --bench list into the shortest and longest line
+// it asks for, counting the newline.
+_Bool parse_bench_profile(const char *profile, size_t *shortest,
+                          size_t *longest) {
+    char low[32];
+    const char *dash = strchr(profile, '-');
 
-    char tmp;
+    if (strcmp(profile, "short") == 0) {
+        *shortest = 40;
+        *longest = 200;
+    } else if (strcmp(profile, "json") == 0) {
+        *shortest = 1 << 10;
+        *longest = 64 << 10;
+    } else if (strcmp(profile, "giant") == 0) {
+        *shortest = *longest = bench_size;
+    } else if (dash && (size_t)(dash - profile) < sizeof low) {
+        memcpy(low, profile, dash - profile);
+        low[dash - profile] = '\0';
+        *shortest = parse_size(low);
+        *longest = parse_size(dash + 1);
+    } else {
+        return 0;
+    }
+    return *shortest && *shortest <= *longest;
+}
 
-    while (left < right) {
-        tmp = *left; *left = *right; *right = tmp;
-        left++; right--;
+// Fills the bench input with lines of printable ASCII, so that every text
+// mode reads it the same way, and works out what the output ought to be.
+// The last line is cut short to land exactly on bench_size.
+void generate_bench_input(size_t shortest, size_t longest) {
+    if (ftruncate(bench_input, 0) != 0
+        || ftruncate(bench_input, bench_size) != 0) {
+        fprintf(stderr, "Can't size the bench input: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+    if (bench_input_map) munmap(bench_input_map, bench_size);
+    bench_input_map = mmap(NULL, bench_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, bench_input, 0);
+    if (bench_input_map == MAP_FAILED) {
+        bench_input_map = NULL;
+        fprintf(stderr, "Can't map the bench input: %s\n", strerror(errno));
+        EXIT_ERR;
     }
+
+    bench_line_count = 0;
+    for (size_t position = 0; position < bench_size; bench_line_count++) {
+        size_t length = shortest + bench_random() % (longest - shortest + 1);
+        if (length > bench_size - position) length = bench_size - position;
+
+        for (size_t i = 0; i + 1 < length; i++) {
+            char byte = ' ' + bench_random() % 95;
+            bench_input_map[position + i] = byte == options.delimiter
+                                            ? byte ^ 1 : byte;
+        }
+        bench_input_map[position + length - 1] = options.delimiter;
+        position += length;
+    }
+
+    if (!bench_expected)
+        bench_expected = take_buffer(bench_size, &bench_expected_capacity);
+    reverse_records(&reverser, bench_expected, bench_input_map, bench_size);
 }
 
-#define END_OF_INPUT (-1)
+// Stands in for whatever would be writing into the pipe of a pipeline.
+void feed_bench_pipe(int fd) {
+    for (size_t position = 0; position < bench_size; ) {
+        ssize_t written = write(fd, bench_input_map + position,
+                                bench_size - position);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) _exit(1);
+        position += written;
+    }
+    _exit(0);
+}
 
-int get_next_line(void) {
-    if (input_file) 
-        return getline(&input_line_buffer, &input_line_size, input_file);
-    return END_OF_INPUT;
+// Both bench files go back to how a fresh invocation would find them: the
+// output empty, both offsets at the start, and no O_DIRECT left over on the
+// descriptions the children shared with us.
+void reset_bench_files(void) {
+    set_direct(bench_input, 0);
+    set_direct(bench_output, 0);
+    if (lseek(bench_input, 0, SEEK_SET) != 0 || ftruncate(bench_output, 0) != 0
+        || lseek(bench_output, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Can't reset the bench files: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
 }
 
-void cleanup(void) {
-    if (input_file) fclose(input_file);
-    if (output_file) fclose(output_file);
-    if (input_line_buffer) free(input_line_buffer);
+// Runs backend once and stores how long it took. The child doesn't get as far
+// as the timing: it sets itself up as the backend's invocation and returns 1,
+// on its way back to main().
+_Bool bench_once(const struct bench_backend *backend, double *seconds) {
+    int feed[2];
+    struct timespec start, end;
+
+    reset_bench_files();
+    if (backend->pipe_input && pipe(feed) != 0) {
+        fprintf(stderr, "Can't make a pipe: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if (child == 0) {
+        if (backend->pipe_input) close(feed[1]);
+        int in = backend->pipe_input ? feed[0] : dup(bench_input);
+        input_file = fdopen(in, "r");
+        output_file = fdopen(dup(bench_output), "w");
+        if (!input_file || !output_file) {
+            EXIT_ERR;
+        }
+        thread_count = backend->parallel ? bench_threads : 1;
+        use_pwrite = backend->pwrite;
+        use_io_uring = backend->io_uring;
+        use_stdio = backend->stdio;
+        if (backend->baseline) {
+            run_baseline();
+            EXIT_SUCC;
+        }
+        return 1;
+    }
+    if (child < 0) {
+        fprintf(stderr, "Can't fork: %s\n", strerror(errno));
+        EXIT_ERR;
+    }
+
+    pid_t feeder = -1;
+    if (backend->pipe_input) {
+        close(feed[0]);
+        feeder = fork();
+        if (feeder == 0) feed_bench_pipe(feed[1]);
+        close(feed[1]);
+    }
+
+    int status;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+    if (feeder > 0) waitpid(feeder, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", backend->name);
+        EXIT_ERR;
+    }
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 0;
 }
 
-#define EXIT_ERR cleanup(); exit(1);
-#define EXIT_SUCC cleanup(); exit(0);
+_Bool bench_output_correct(void) {
+    struct stat info;
+    if (fstat(bench_output, &info) != 0 || (size_t)info.st_size != bench_size)
+        return 0;
 
-// This function is neat because it emerged as a result of refactoring.
-// In the rough draft I just had it in the main function to open the input file,
-// check for success, then open the output file and check. If the output failed
-// to open, I made sure to close the input file. Thus they were different enough
-// that I wondered whether it'd even be worthwhile to try and combine them into
-// a single function, despite how similar they were. After creating the above
-// cleanup function for a different reason, I found I was now able to write a
-// generic method easily. I made sure ptr was the first argument - by looking at
-// how this function is used in main you can see how this prevents this generic
-// function from making the code less readable.
-void open(FILE **ptr, char *filename, char *mode) {
-    *ptr = fopen(filename, mode);
-    if (!*ptr) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
+    void *output = mmap(NULL, bench_size, PROT_READ, MAP_SHARED, bench_output, 0);
+    if (output == MAP_FAILED) return 0;
+    _Bool same = memcmp(output, bench_expected, bench_size) == 0;
+    munmap(output, bench_size);
+    return same;
+}
+
+int compare_times(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank, so p99 of ten runs is simply the slowest.
+double bench_percentile(long percent) {
+    long rank = (percent * bench_runs + 99) / 100;
+    return bench_times[rank > 0 ? rank - 1 : 0];
+}
+
+// Throughput is worked out from the median run.
+void report_backend(const struct bench_backend *backend) {
+    char label[64];
+    if (backend->parallel) {
+        snprintf(label, sizeof label, "mmap -j %ld%s", bench_threads,
+                 backend->pwrite ? " --pwrite" : "");
+    } else {
+        snprintf(label, sizeof label, "%s", backend->name);
+    }
+
+    qsort(bench_times, bench_runs, sizeof *bench_times, compare_times);
+    double median = bench_percentile(50);
+    printf("  %-22s %9.1f %12.0f %9.2f %9.2f %9.2f\n", label,
+           bench_size / 1e6 / median, bench_line_count / median,
+           bench_percentile(50) * 1e3, bench_percentile(90) * 1e3,
+           bench_percentile(99) * 1e3);
+}
+
+// Every backend gets one run that isn't timed, partly to check its output
+// and partly so the first timed run doesn't pay for faulting in the page
+// cache.
+_Bool bench_backend(const struct bench_backend *backend) {
+    if (bench_once(backend, &bench_times[0])) return 1;
+    if (!bench_output_correct()) {
+        printf("  %-22s wrong output, skipped\n", backend->name);
+        return 0;
+    }
+    for (long run = 0; run < bench_runs; run++)
+        if (bench_once(backend, &bench_times[run])) return 1;
+    report_backend(backend);
+    return 0;
+}
+
+int make_bench_file(void) {
+    const char *directory = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof path, "%s/reverse-bench-XXXXXX",
+             directory && *directory ? directory : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", path, strerror(errno));
         EXIT_ERR;
     }
+    unlink(path);
+    return fd;
 }
 
-void print_usage(char *program) {
-    fprintf(stderr, "Usage: %s [in-file] [out-file]\n", program);
+// Only the children come back from here, each one with input_file and
+// output_file open and the globals set for whichever backend it's running.
+// The parent prints the report and exits.
+void run_benchmarks(void) {
+    // A page of --stats after every run would bury the report.
+    collect_stats = 0;
+    bench_input = make_bench_file();
+    bench_output = make_bench_file();
+    bench_threads = thread_count > 1 ? thread_count
+                                     : sysconf(_SC_NPROCESSORS_ONLN);
+    if (bench_threads < 2) bench_threads = 2;
+    if (bench_threads > MAX_THREADS) bench_threads = MAX_THREADS;
+
+    char *list = strdup(bench_profiles);
+    if (!list) {
+        fprintf(stderr, "Out of memory\n");
+        EXIT_ERR;
+    }
+    for (char *profile = strtok(list, ","); profile; profile = strtok(NULL, ",")) {
+        size_t shortest, longest;
+        if (!parse_bench_profile(profile, &shortest, &longest)) {
+            fprintf(stderr, "Unknown bench profile: %s\n", profile);
+            EXIT_ERR;
+        }
+        generate_bench_input(shortest, longest);
+
+        printf("%s: %.1f MB in %zu lines of %zu to %zu bytes, %ld runs each\n",
+               profile, bench_size / 1e6, bench_line_count, shortest,
+               longest < bench_size ? longest : bench_size, bench_runs);
+        printf("  %-22s %9s %12s %9s %9s %9s\n", "backend", "MB/s", "lines/s",
+               "p50 ms", "p90 ms", "p99 ms");
+
+        size_t count = sizeof bench_backends / sizeof *bench_backends;
+        for (size_t i = 0; i < count; i++) {
+            if (bench_backends[i].baseline && !baseline_applies()) continue;
+            if (bench_backend(&bench_backends[i])) return;
+        }
+    }
+    free(list);
+    EXIT_SUCC;
+}
+
+// --batch reverses a whole list of files in one run, for jobs that would
+// otherwise start this program tens of thousands of times over small files.
+// The pairs come from a manifest, one "in-file<TAB>out-file" per line, or
+// if there's no manifest, from the command line two at a time. A pool of -j
+// threads (one per CPU unless -j says otherwise) takes the pairs in turn.
+// Every worker has a stream context and buffers of its own, and keeps them
+// from one file to the next, so a run with a million small files allocates
+// about as often as a run with one.
+//
+// Each file goes through the streaming stage in blocks, whatever kind of
+// file it is; for small files that's a read, a reverse and a write. A file
+// that fails doesn't stop the rest. Every pair gets a line on stdout as it
+// finishes, in whatever order that is:
+//
+//   0<TAB>in-file<TAB>out-file
+//   1<TAB>in-file<TAB>out-file<TAB>what went wrong
+//
+// and the exit status is 1 if any of them failed. -d, --crlf, --utf8, -b and
+// --stats carry over to batch mode; the options that choose how one big file
+// is handled don't.
+_Bool batch_mode = 0;
+const char *batch_manifest = NULL;
+
+struct batch_pair {
+    char *input;
+    char *output;
+};
+
+struct batch_pair *batch_pairs = NULL;
+size_t batch_pair_count = 0;
+size_t batch_next_pair = 0;
+_Bool batch_failed = 0;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct batch_worker {
+    struct reverse_context context;
+    char *block;
+    size_t block_size;
+    char *spill;
+    size_t spill_size;
+    char *output;
+    size_t output_capacity;
+    size_t output_used;
+    int output_fd;
+    int write_error;
+};
+
+// write_all() gives up on the whole run when a write fails. Here only the
+// file is given up on, so the error is handed back instead.
+int batch_write(struct batch_worker *worker, const char *data, size_t length) {
+    while (length) {
+        uint64_t started = stats_begin(STATS_WRITE);
+        ssize_t written = write(worker->output_fd, data, length);
+        stats_end(STATS_WRITE, started, written > 0 ? written : 0);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return ETIMEDOUT;
+        if (written <= 0) return written < 0 ? errno : EIO;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int batch_flush(struct batch_worker *worker) {
+    int error = batch_write(worker, worker->output, worker->output_used);
+    worker->output_used = 0;
+    return error;
+}
+
+// The emit callback. 1 stops the stream, and can't be mistaken for the -1
+// that a full spill gets.
+int batch_emit(void *user, const char *data, size_t length) {
+    struct batch_worker *worker = user;
+    if (worker->output_used + length > worker->output_capacity) {
+        worker->write_error = batch_flush(worker);
+        if (worker->write_error) return 1;
+    }
+    if (length > worker->output_capacity) {
+        worker->write_error = batch_write(worker, data, length);
+        return worker->write_error ? 1 : 0;
+    }
+    memcpy(worker->output + worker->output_used, data, length);
+    worker->output_used += length;
+    return 0;
+}
+
+void grow_batch_spill(struct batch_worker *worker) {
+    size_t size = 2 * worker->spill_size;
+    char *spill = take_buffer(size, &size);
+    reverse_set_spill(&worker->context, spill, size);
+    give_buffer(worker->spill, worker->spill_size);
+    worker->spill = spill;
+    worker->spill_size = size;
+}
+
+// Streams in into the worker's output for one pair. Returns 0, or fills in
+// message and returns 1.
+_Bool batch_stream(struct batch_worker *worker, int in, char *message,
+                   size_t size) {
+    for (;;) {
+        uint64_t started = stats_begin(STATS_READ);
+        ssize_t got = read(in, worker->block, worker->block_size);
+        stats_end(STATS_READ, started, got > 0 ? got : 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            int error = errno == EAGAIN || errno == EWOULDBLOCK ? ETIMEDOUT
+                                                                : errno;
+            snprintf(message, size, "Error reading input: %s",
+                     strerror(error));
+            return 1;
+        }
+
+        int status;
+        if (got == 0) {
+            stats_finish_lines();
+            status = reverse_finish(&worker->context, batch_emit, worker);
+        } else {
+            started = stats_begin_batch(worker->block, got, 1);
+            while ((status = reverse_push(&worker->context, worker->block, got,
+                                          batch_emit, worker)) == -1
+                   && errno == ENOBUFS)
+                grow_batch_spill(worker);
+            stats_end_batch(started, got);
+        }
+        if (status) {
+            snprintf(message, size, "Error writing output: %s",
+                     strerror(worker->write_error));
+            return 1;
+        }
+        if (got == 0) break;
+    }
+
+    int error = batch_flush(worker);
+    if (error) {
+        snprintf(message, size, "Error writing output: %s", strerror(error));
+        return 1;
+    }
+    return 0;
+}
+
+// How many workers a pool gets: -j, or one thread per CPU.
+long pool_size(void) {
+    long threads = thread_count > 1 ? thread_count
+                                    : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    return threads;
+}
+
+// A stream that failed partway leaves its unfinished record in the spill and
+// its output in the buffer, and neither belongs to the next one.
+void reset_batch_worker(struct batch_worker *worker) {
+    char *held;
+    reverse_drain_spill(&worker->context, &held);
+    worker->output_used = 0;
+}
+
+// "-" can't mean anything in a batch: there's only one stdin and stdout to
+// go round.
+_Bool batch_reverse_pair(struct batch_worker *worker, struct batch_pair *pair,
+                         char *message, size_t size) {
+    if (strcmp(pair->input, "-") == 0 || strcmp(pair->output, "-") == 0) {
+        snprintf(message, size, "\"-\" isn't allowed in a batch");
+        return 1;
+    }
+    int in = open(pair->input, O_RDONLY);
+    if (in < 0) {
+        snprintf(message, size, "Error opening file: %s: %s", pair->input,
+                 strerror(errno));
+        return 1;
+    }
+    worker->output_fd = open(pair->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (worker->output_fd < 0) {
+        snprintf(message, size, "Error opening file: %s: %s", pair->output,
+                 strerror(errno));
+        close(in);
+        return 1;
+    }
+
+    stats_line_run = 0;
+    stats_run_known = 1;
+    _Bool failed = batch_stream(worker, in, message, size);
+    if (failed) reset_batch_worker(worker);
+    if (close(worker->output_fd) != 0 && !failed) {
+        snprintf(message, size, "Error writing output: %s", strerror(errno));
+        failed = 1;
+    }
+    close(in);
+    return failed;
+}
+
+void start_batch_worker(struct batch_worker *worker) {
+    worker->output_fd = -1;
+    reverse_init(&worker->context, &options);
+    worker->block = take_buffer(DEFAULT_INPUT_BLOCK_SIZE, &worker->block_size);
+    worker->spill = take_buffer(DEFAULT_INPUT_BLOCK_SIZE, &worker->spill_size);
+    worker->output = take_buffer(output_buffer_size, &worker->output_capacity);
+    reverse_set_spill(&worker->context, worker->spill, worker->spill_size);
+}
+
+void stop_batch_worker(struct batch_worker *worker) {
+    give_buffer(worker->block, worker->block_size);
+    give_buffer(worker->spill, worker->spill_size);
+    give_buffer(worker->output, worker->output_capacity);
+}
+
+void *reverse_batch_pairs(void *unused) {
+    (void)unused;
+    struct batch_worker worker;
+    start_batch_worker(&worker);
+
+    for (;;) {
+        pthread_mutex_lock(&batch_lock);
+        size_t index = batch_next_pair++;
+        pthread_mutex_unlock(&batch_lock);
+        if (index >= batch_pair_count) break;
+
+        struct batch_pair *pair = &batch_pairs[index];
+        char message[512];
+        _Bool failed = batch_reverse_pair(&worker, pair, message,
+                                          sizeof message);
+
+        pthread_mutex_lock(&batch_lock);
+        if (failed) {
+            batch_failed = 1;
+            printf("1\t%s\t%s\t%s\n", pair->input, pair->output, message);
+        } else {
+            printf("0\t%s\t%s\n", pair->input, pair->output);
+        }
+        pthread_mutex_unlock(&batch_lock);
+    }
+
+    stop_batch_worker(&worker);
+    return NULL;
+}
+
+void add_batch_pair(char *input, char *output) {
+    if ((batch_pair_count & (batch_pair_count - 1)) == 0) {
+        size_t capacity = batch_pair_count ? 2 * batch_pair_count : 1;
+        struct batch_pair *grown = realloc(batch_pairs,
+                                           capacity * sizeof *batch_pairs);
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            EXIT_ERR;
+        }
+        batch_pairs = grown;
+    }
+    batch_pairs[batch_pair_count].input = input;
+    batch_pairs[batch_pair_count].output = output;
+    batch_pair_count++;
+}
+
+// Blank lines are skipped, and so is a '\r' at the end of a line, in case the
+// manifest was written on Windows. The output name is everything after the
+// first tab, spaces and all.
+void read_batch_manifest(void) {
+    FILE *manifest = strcmp(batch_manifest, "-") == 0
+                     ? stdin : fopen(batch_manifest, "r");
+    if (!manifest) {
+        fprintf(stderr, "Error opening file: %s\n", batch_manifest);
+        EXIT_ERR;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    for (size_t number = 1; (length = getline(&line, &size, manifest)) != -1;
+         number++) {
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (!length) continue;
+
+        char *tab = strchr(line, '\t');
+        if (!tab || tab == line || !tab[1]) {
+            fprintf(stderr, "%s:%zu: expected in-file<TAB>out-file\n",
+                    batch_manifest, number);
+            EXIT_ERR;
+        }
+        *tab = '\0';
+        char *input = strdup(line), *output = strdup(tab + 1);
+        if (!input || !output) {
+            fprintf(stderr, "Out of memory\n");
+            EXIT_ERR;
+        }
+        add_batch_pair(input, output);
+    }
+    free(line);
+    if (manifest != stdin) fclose(manifest);
+}
+
+// Never returns. The status lines go out through stdio from all the workers
+// at once, under batch_lock.
+void reverse_batch(char *args[], int count) {
+    if (batch_manifest) {
+        read_batch_manifest();
+    } else {
+        for (int i = 0; i + 1 < count; i += 2)
+            add_batch_pair(args[i], args[i + 1]);
+    }
+
+    long threads = pool_size();
+    if ((size_t)threads > batch_pair_count) threads = batch_pair_count;
+
+    pthread_t workers[MAX_THREADS];
+    workers_running = 1;
+    for (long i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, reverse_batch_pairs, NULL) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            EXIT_ERR;
+        }
+    }
+    for (long i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    workers_running = 0;
+
+    fflush(stdout);
+    if (batch_failed) {
+        EXIT_ERR;
+    }
+    EXIT_SUCC;
+}
+
+// --serve keeps the program running for callers that would otherwise start
+// it thousands of times over on small inputs. It listens on a Unix socket,
+// and every connection is one input: the client writes it, shuts down its
+// side for writing, and reads the reversed output back until the server
+// closes the connection, which is just what `socat - UNIX-CONNECT:SOCKET`
+// does. A pool of -j threads (one per CPU unless -j says otherwise) takes the
+// connections as they come. Each is a batch worker, with its stream context
+// and buffers kept from one connection to the next, so a request costs the
+// connection and nothing else. -d, --crlf, --utf8, -b and the field options
+// apply to every request. A request that fails is logged to stderr and only
+// loses its own connection; the server runs until it's killed. A socket file
+// left behind by one that's gone is taken over, but not one still in use.
+//
+// A worker is tied up for as long as its client takes, so a client that
+// connects and then goes quiet would hold on to it for good, and a few of
+// them would stop the server altogether. Every read and write on a
+// connection is given SERVE_TIMEOUT seconds, and a connection that makes no
+// progress for that long is dropped. A client that keeps sending can still
+// take as long as it likes over a big input.
+#define SERVE_TIMEOUT 10
+
+const char *serve_path = NULL;
+int serve_socket = -1;
+
+void *serve_connections(void *unused) {
+    (void)unused;
+    struct batch_worker worker;
+    start_batch_worker(&worker);
+
+    for (;;) {
+        int connection = accept(serve_socket, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error accepting a connection: %s\n",
+                    strerror(errno));
+            if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS
+                && errno != ENOMEM)
+                break;
+            // Out of descriptors or memory: give the others time to finish.
+            usleep(10000);
+            continue;
+        }
+
+        struct timeval timeout = { SERVE_TIMEOUT, 0 };
+        if (setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof timeout) != 0
+            || setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                          sizeof timeout) != 0) {
+            fprintf(stderr, "Dropped a connection: %s\n", strerror(errno));
+            close(connection);
+            continue;
+        }
+
+        char message[512];
+        worker.output_fd = connection;
+        stats_line_run = 0;
+        stats_run_known = 1;
+        if (batch_stream(&worker, connection, message, sizeof message)) {
+            reset_batch_worker(&worker);
+            fprintf(stderr, "Dropped a connection: %s\n", message);
+        }
+        close(connection);
+    }
+
+    stop_batch_worker(&worker);
+    return NULL;
+}
+
+_Bool bind_serve_socket(const struct sockaddr_un *address) {
+    return bind(serve_socket, (const struct sockaddr *)address,
+                sizeof *address) == 0;
+}
+
+// Whether a server is still answering on the socket.
+_Bool serve_socket_live(const struct sockaddr_un *address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) return 1;
+    _Bool live = connect(probe, (const struct sockaddr *)address,
+                         sizeof *address) == 0 || errno != ECONNREFUSED;
+    close(probe);
+    return live;
+}
+
+void serve(void) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(serve_path) >= sizeof address.sun_path) {
+        fprintf(stderr, "Socket path too long: %s\n", serve_path);
+        EXIT_ERR;
+    }
+    strcpy(address.sun_path, serve_path);
+
+    serve_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    _Bool bound = serve_socket >= 0 && bind_serve_socket(&address);
+    if (!bound && serve_socket >= 0 && errno == EADDRINUSE
+        && !serve_socket_live(&address) && unlink(serve_path) == 0)
+        bound = bind_serve_socket(&address);
+    if (!bound || listen(serve_socket, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", serve_path,
+                strerror(errno));
+        EXIT_ERR;
+    }
+    // A client that hangs up early makes our writes fail with EPIPE, rather
+    // than taking the whole server with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    long threads = pool_size();
+    pthread_t workers[MAX_THREADS];
+    workers_running = 1;
+    for (long i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, serve_connections, NULL) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            EXIT_ERR;
+        }
+    }
+    for (long i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    workers_running = 0;
+    EXIT_ERR;
+}
+
+// --plan is the coordinator's side of --shard and --range. Given N, or the
+// ranges each machine will be handed as START:END,START:END,..., it prints
+// where each one really starts and ends once snapped to lines, as K/N, start,
+// end and length separated by tabs, in a form scripts can cut up. Then it
+// checks the ranges tile the file, in order, and fails if any bytes would be
+// left out or done twice. Ranges that meet end to end always pass; the check
+// is for lists put together by hand or by other tools.
+const char *plan_text = NULL;
+
+void run_plan(char *filename) {
+    struct stat info;
+    open_file(&input_file, filename, "r");
+    int in = fileno(input_file);
+    if (input_compression || fstat(in, &info) != 0
+        || !S_ISREG(info.st_mode)) {
+        fprintf(stderr, "--plan needs an uncompressed regular input file\n");
+        EXIT_ERR;
+    }
+
+    char *end;
+    long count = strtol(plan_text, &end, 10);
+    _Bool equal_shares = *end == '\0' && end != plan_text;
+    if (!equal_shares) {
+        count = 1;
+        for (const char *c = plan_text; *c; c++) count += *c == ',';
+    }
+    if (count < 1) {
+        fprintf(stderr, "Invalid plan: %s\n", plan_text);
+        EXIT_ERR;
+    }
+
+    size_t size = info.st_size;
+    size_t covered = 0;
+    _Bool tiles = 1;
+    const char *text = plan_text;
+    for (long k = 1; k <= count; k++) {
+        size_t first = shard_offset(size, k - 1, count);
+        size_t last = shard_offset(size, k, count);
+        if (!equal_shares) {
+            char range[64];
+            size_t length = strcspn(text, ",");
+            if (length >= sizeof range) length = sizeof range - 1;
+            memcpy(range, text, length);
+            range[length] = '\0';
+            if (!parse_range(range, &first, &last)) {
+                fprintf(stderr, "Invalid range: %s\n", range);
+                EXIT_ERR;
+            }
+            text += strcspn(text, ",") + 1;
+        }
+
+        size_t start = snap_to_line(in, first, size);
+        size_t stop = snap_to_line(in, last, size);
+        printf("%ld/%ld\t%zu\t%zu\t%zu\n", k, count, start, stop,
+               stop - start);
+        _Bool gap = start > covered;
+        _Bool overlap = start < covered && stop > start;
+        if (gap)
+            fprintf(stderr, "Bytes %zu to %zu are in no range\n", covered,
+                    start);
+        if (overlap)
+            fprintf(stderr, "Range %ld/%ld overlaps the ones before it\n", k,
+                    count);
+        if (gap || overlap) tiles = 0;
+        if (stop > covered) covered = stop;
+    }
+    if (covered < size) {
+        fprintf(stderr, "Bytes %zu to %zu are in no range\n", covered, size);
+        tiles = 0;
+    }
+
+    fflush(stdout);
+    if (!tiles) {
+        EXIT_ERR;
+    }
+    EXIT_SUCC;
+}
+
+// Returns the index of the first positional argument, like getopt's optind.
+// Options only ever fill in the globals above; nothing is acted upon until
+// main() has seen all of them.
+int parse_options(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "buffer-size", required_argument, NULL, 'b' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "pwrite", no_argument, NULL, 'P' },
+        { "affinity", optional_argument, NULL, 'Y' },
+        { "in-place", no_argument, NULL, 'I' },
+        { "io-uring", no_argument, NULL, 'U' },
+        { "utf8", optional_argument, NULL, '8' },
+        { "delimiter", required_argument, NULL, 'd' },
+        { "crlf", no_argument, NULL, 'C' },
+        { "tac", optional_argument, NULL, 'L' },
+        { "stdio", no_argument, NULL, 'F' },
+        { "fields", required_argument, NULL, 'f' },
+        { "field-separator", required_argument, NULL, 't' },
+        { "reverse-field-order", no_argument, NULL, 'O' },
+        { "max-line-memory", required_argument, NULL, 'M' },
+        { "huge-pages", no_argument, NULL, 'H' },
+        { "direct", no_argument, NULL, 'D' },
+        { "no-cache-pollution", no_argument, NULL, 'N' },
+        { "stats", optional_argument, NULL, 'T' },
+        { "stats-sample", required_argument, NULL, 'E' },
+        { "batch", optional_argument, NULL, 'A' },
+        { "bench", optional_argument, NULL, 'B' },
+        { "bench-size", required_argument, NULL, 'S' },
+        { "bench-runs", required_argument, NULL, 'R' },
+        { "range", required_argument, NULL, 'W' },
+        { "shard", required_argument, NULL, 'K' },
+        { "part", no_argument, NULL, 'Q' },
+        { "plan", required_argument, NULL, 'G' },
+        { "verify", no_argument, NULL, 'V' },
+        { "serve", required_argument, NULL, 'X' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "b:d:f:j:t:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'b':
+            output_buffer_size = chunk_size = parse_size(optarg);
+            if (!output_buffer_size) {
+                fprintf(stderr, "Invalid buffer size: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'P':
+            use_pwrite = 1;
+            break;
+        case 'I':
+            in_place = 1;
+            break;
+        case 'W':
+        case 'K':
+            if (range_given) {
+                fprintf(stderr, "Only one --range or --shard can be given\n");
+                EXIT_ERR;
+            }
+            range_given = 1;
+            if (option == 'W' && !parse_range(optarg, &range_first,
+                                              &range_last)) {
+                fprintf(stderr, "Invalid range: %s\n", optarg);
+                EXIT_ERR;
+            }
+            if (option == 'K' && !parse_shard(optarg)) {
+                fprintf(stderr, "Invalid shard: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'Q':
+            part_output = 1;
+            break;
+        case 'G':
+            plan_text = optarg;
+            break;
+        case 'V':
+            verifying = 1;
+            break;
+        case 'X':
+            serve_path = optarg;
+            break;
+        case 'Y':
+            if (!optarg || strcmp(optarg, "nodes") == 0) {
+                affinity = AFFINITY_NODES;
+            } else if (strcmp(optarg, "cpus") == 0) {
+                affinity = AFFINITY_CPUS;
+            } else if (strcmp(optarg, "none") == 0) {
+                affinity = AFFINITY_NONE;
+            } else {
+                fprintf(stderr, "Unknown --affinity: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'U':
+            use_io_uring = 1;
+            break;
+        case 'd':
+            if (!parse_delimiter(optarg, &options.delimiter)) {
+                fprintf(stderr, "Invalid delimiter: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'C':
+            options.keep_crlf = 1;
+            break;
+        case 'F':
+            use_stdio = 1;
+            break;
+        case 'L':
+            tac_mode = 1;
+            if (optarg && strcmp(optarg, "reversed") == 0) {
+                tac_reverse_lines = 1;
+            } else if (optarg) {
+                fprintf(stderr, "Unknown --tac mode: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'f':
+            if (!parse_field_list(optarg)) {
+                fprintf(stderr, "Invalid field list: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 't':
+            if (!parse_delimiter(optarg, &options.field_separator)) {
+                fprintf(stderr, "Invalid field separator: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'O':
+            options.reverse_field_order = 1;
+            break;
+        case 'H':
+            use_huge_pages = 1;
+            break;
+        case 'D':
+            use_direct_io = 1;
+            break;
+        case 'N':
+            no_cache_pollution = 1;
+            break;
+        case 'T':
+            collect_stats = 1;
+            clock_gettime(CLOCK_MONOTONIC, &stats_started);
+            if (optarg && strcmp(optarg, "json") == 0) {
+                stats_json = 1;
+            } else if (optarg && strcmp(optarg, "text") != 0) {
+                fprintf(stderr, "Unknown --stats format: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'E':
+            stats_sample = strtoull(optarg, NULL, 10);
+            if (!stats_sample) {
+                fprintf(stderr, "Invalid stats sample: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'A':
+            batch_mode = 1;
+            batch_manifest = optarg;
+            break;
+        case 'B':
+            bench_mode = 1;
+            if (optarg) bench_profiles = optarg;
+            break;
+        case 'S':
+            bench_size = parse_size(optarg);
+            if (!bench_size) {
+                fprintf(stderr, "Invalid bench size: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'R':
+            bench_runs = strtol(optarg, NULL, 10);
+            if (bench_runs < 1 || bench_runs > BENCH_MAX_RUNS) {
+                fprintf(stderr, "Invalid bench run count: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'M':
+            max_line_memory = parse_size(optarg);
+            if (!max_line_memory) {
+                fprintf(stderr, "Invalid line memory cap: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case '8':
+            options.text_mode = REVERSE_CODE_POINTS;
+            if (optarg && strcmp(optarg, "graphemes") == 0) {
+                options.text_mode = REVERSE_GRAPHEMES;
+            } else if (optarg) {
+                fprintf(stderr, "Unknown --utf8 mode: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        case 'j':
+            thread_count = strtol(optarg, NULL, 10);
+            if (thread_count < 1 || thread_count > MAX_THREADS) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                EXIT_ERR;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            EXIT_ERR;
+        }
+    }
+    return optind;
+}
+
+// There's no output file and no output buffer in this mode. An empty file
+// has nothing to reverse, so it only counts as an error if the file is
+// something that can't be mapped at all.
+void reverse_file_in_place(char *filename) {
+    open_file(&input_file, filename, "r+");
+
+    struct stat info;
+    if (fstat(fileno(input_file), &info) == 0 && S_ISREG(info.st_mode)
+        && info.st_size == 0)
+        return;
+    if (!map_input()) {
+        fprintf(stderr, "Can't map %s for in-place reversal\n", filename);
+        EXIT_ERR;
+    }
+
+    if (verifying && thread_count <= 1)
+        verify_add(&verify_input, input_map, input_map_size);
+    if (thread_count > 1)
+        reverse_in_parallel();
+    else
+        reverse_records(&reverser, input_map, input_map, input_map_size);
+    if (verifying && thread_count <= 1)
+        verify_add(&verify_output, input_map, input_map_size);
+}
+
+// Output buffers are page-aligned so they can be spliced, and because it
+// costs nothing when they aren't.
+void allocate_output_buffer(void) {
+    output_buffer = take_buffer(output_buffer_size, &output_buffer_capacity);
+    if (splice_output)
+        output_spare = take_buffer(output_buffer_size, &output_buffer_capacity);
+}
+
+void allocate_input_block(void) {
+    input_block = take_buffer(DEFAULT_INPUT_BLOCK_SIZE, &input_block_size);
+}
+
+// The output buffer is always a whole number of pages, so rounding the size
+// up to one doesn't need a bigger buffer.
+void prepare_direct_output(void) {
+    struct stat info;
+    if (!use_direct_io || splice_output) return;
+    if (fstat(fileno(output_file), &info) != 0 || !S_ISREG(info.st_mode))
+        return;
+
+    output_buffer_size = (output_buffer_size + BUFFER_ALIGNMENT - 1)
+                         / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    direct_output = set_direct(fileno(output_file), 1);
+}
+
+// Asks for a pipe as big as the -b buffer, then takes whatever the kernel
+// actually granted as the buffer size, since the splicing scheme relies on a
+// buffer being exactly one pipe-full.
+void prepare_splice_output(void) {
+#ifdef __linux__
+    struct stat info;
+    if (output_compression) return;
+    if (fstat(fileno(output_file), &info) != 0 || !S_ISFIFO(info.st_mode))
+        return;
+
+    fcntl(fileno(output_file), F_SETPIPE_SZ, (int)output_buffer_size);
+    int pipe_size = fcntl(fileno(output_file), F_GETPIPE_SZ);
+    if (pipe_size <= 0) return;
+
+    output_buffer_size = pipe_size;
+    splice_output = 1;
+#endif
+}
+
+// The tiny-file path. Callers that run this thousands of times a second on
+// files of a few hundred bytes mostly pay for getting started, so a small
+// regular file skips everything that's there for big ones: no stdio, no
+// buffer pool, no mapping or compression checks, just an open, an fstat and
+// one read into the stack, the reverse, and one write. Anything it isn't sure
+// of is left to the usual paths, with the input put back the way it was
+// found. Linking with -static takes the dynamic loader out of the start-up as
+// well; see the build line at the bottom.
+#define TINY_FILE_SIZE (64 << 10)
+
+_Bool tiny_file_applies(void) {
+    return !range_given && !verifying && !collect_stats && !no_cache_pollution
+           && !use_stdio;
+}
+
+void write_tiny_file(int out, const char *data, size_t length) {
+    while (length) {
+        ssize_t written = write(out, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            EXIT_ERR;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Returns 0, having opened nothing, if the input isn't a plain small file.
+// An input that can't be opened is left for open_file() to complain about.
+_Bool reverse_tiny_file(char *input_name, char *output_name) {
+    if (compression_for_name(output_name) != COMPRESSION_NONE) return 0;
+    _Bool from_stdin = strcmp(input_name, "-") == 0;
+    int in = from_stdin ? STDIN_FILENO : open(input_name, O_RDONLY);
+    if (in < 0) return 0;
+
+    struct stat info;
+    off_t position = from_stdin ? lseek(in, 0, SEEK_CUR) : 0;
+    char input[TINY_FILE_SIZE + 1], output[TINY_FILE_SIZE];
+    size_t length = 0;
+    _Bool tiny = position >= 0 && fstat(in, &info) == 0
+                 && S_ISREG(info.st_mode)
+                 && info.st_size - position <= TINY_FILE_SIZE;
+    while (tiny && length <= TINY_FILE_SIZE) {
+        ssize_t got = read(in, input + length, sizeof input - length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) tiny = 0;
+        if (got <= 0) break;
+        length += got;
+    }
+    tiny = tiny && length <= TINY_FILE_SIZE
+           && compression_for_magic(input, length) == COMPRESSION_NONE;
+    if (!tiny) {
+        if (from_stdin) lseek(in, position, SEEK_SET);
+        else close(in);
+        return 0;
+    }
+    if (!from_stdin) close(in);
+
+    int out = strcmp(output_name, "-") == 0
+              ? STDOUT_FILENO
+              : open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        fprintf(stderr, "Error opening file: %s\n", output_name);
+        EXIT_ERR;
+    }
+    char *reversed = input;
+    if (tac_mode) {
+        reverse_record_order(&reverser, output, input, length,
+                             tac_reverse_lines);
+        reversed = output;
+    } else {
+        reverse_records(&reverser, input, input, length);
+    }
+    write_tiny_file(out, reversed, length);
+    if (out != STDOUT_FILENO) close(out);
+    return 1;
+}
+
+// --tac. The lines have to be read from the end, so the input has to be
+// mapped; anything that can't be, a pipe or a compressed file, is copied to
+// a temporary file first and that's mapped instead. Either way the memory it
+// takes doesn't grow with the input: the kernel pages the mapping in and out,
+// and only the output buffer is ours. The mapping is walked back a window at
+// a time with memrchr(), which glibc vectorizes. The kernel's readahead only
+// looks forwards, so the window below is asked for before we get there, and
+// with --no-cache-pollution the one above is dropped once we're past it.
+// With -j the chunks are cut from the end instead; see claim_chunk().
+void spill_input_for_tac(void) {
+    FILE *spill = tmpfile();
+    if (!spill) {
+        fprintf(stderr, "Error creating temporary file: %s\n",
+                strerror(errno));
+        EXIT_ERR;
+    }
+
+    allocate_input_block();
+    size_t got;
+    while ((got = read_input_block())) {
+        char *data = input_block;
+        while (got) {
+            ssize_t written = write(fileno(spill), data, got);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                fprintf(stderr, "Error writing temporary file: %s\n",
+                        strerror(errno));
+                EXIT_ERR;
+            }
+            data += written;
+            got -= written;
+        }
+    }
+    fclose(input_file);
+    input_file = spill;
+    input_compression = COMPRESSION_NONE;
+}
+
+void output_tac_line(const char *line, size_t length) {
+    if (!tac_reverse_lines) {
+        output_bytes(line, length);
+        return;
+    }
+    size_t kept = reverse_terminator_length(&reverser, line, length);
+    output_reversed(line, length - kept);
+    output_bytes(line + length - kept, kept);
+}
+
+// Each window's lines are one batch, starting with the line the window's
+// lower edge falls in.
+void output_lines_from_end(void) {
+    char delimiter = options.delimiter;
+    size_t end = input_map_size;
+    size_t dropped = input_map_size;
+    while (end) {
+        size_t floor = (end - 1) & ~(size_t)(CACHE_WINDOW - 1);
+        if (floor)
+            madvise(input_map + floor - CACHE_WINDOW, CACHE_WINDOW,
+                    MADV_WILLNEED);
+        const char *found = memrchr(input_map, delimiter, floor);
+        size_t start = found ? (size_t)(found - input_map) + 1 : 0;
+
+        uint64_t started = stats_begin_batch(input_map + start, end - start, 0);
+        if (verifying)
+            verify_add_before(&verify_input, input_map + start, end - start);
+        for (size_t line_end = end; line_end > start;) {
+            found = memrchr(input_map + start, delimiter, line_end - 1 - start);
+            size_t line_start = found ? (size_t)(found - input_map) + 1 : start;
+            output_tac_line(input_map + line_start, line_end - line_start);
+            line_end = line_start;
+        }
+        stats_end_batch(started, end - start);
+        end = start;
+
+#ifdef __linux__
+        size_t done = (end + CACHE_WINDOW - 1) & ~(size_t)(CACHE_WINDOW - 1);
+        if (drop_input && done < dropped) {
+            madvise(input_map + done, dropped - done, MADV_DONTNEED);
+            posix_fadvise(fileno(input_file), done, dropped - done,
+                          POSIX_FADV_DONTNEED);
+            dropped = done;
+        }
+#endif
+    }
+}
+
+void reverse_line_order(void) {
+    if (!map_input()) {
+        spill_input_for_tac();
+        if (!map_input()) return;
+    }
+    madvise(input_map, input_map_size, MADV_NORMAL);
+
+    if (thread_count > 1) {
+        reverse_in_parallel();
+        return;
+    }
+    prepare_direct_output();
+    output_lines_from_end();
+    flush_output();
 }
 
 int main(int argc, char *argv[]) {
+    int first_arg = parse_options(argc, argv);
+
     // This seemingly pointless variable serves an explanatory purpose. While
     // you could easily infer that the reason we're checking argc is to validate
     // the given arguments, I think minimizing that mental jugglery really adds
     // up across an entire codebase. Note too how it communicates something
     // subtle about this program's correctness. There's an amount of dissonance
     // on reading that all we check to make sure the arguments are correct is
-    // whether or not there's 3 of them. Argument handling clearly isn't very
-    // robust and might be worth revisting later.
-    _Bool args_correct = argc == 3;
+    // whether or not there's the right number of them left after the options.
+    // Argument handling clearly isn't very robust and might be worth revisting
+    // later.
+    int arg_count = argc - first_arg;
+    _Bool args_correct = arg_count == (in_place ? 1 : 2);
+    if (batch_mode)
+        args_correct = batch_manifest ? arg_count == 0
+                                      : arg_count > 0 && arg_count % 2 == 0;
+    if (bench_mode) args_correct = arg_count == 0;
+    if ((batch_mode || bench_mode) && in_place) args_correct = 0;
+    if (tac_mode && (batch_mode || bench_mode || in_place)) args_correct = 0;
+    if (range_given && (batch_mode || bench_mode || in_place || tac_mode
+                        || use_stdio))
+        args_correct = 0;
+    if (verifying && (batch_mode || bench_mode)) args_correct = 0;
+    if (serve_path)
+        args_correct = arg_count == 0 && !batch_mode && !bench_mode
+                       && !in_place && !tac_mode && !range_given
+                       && !verifying && !plan_text;
+    if (plan_text)
+        args_correct = arg_count == 1 && !range_given && !verifying
+                       && !batch_mode && !bench_mode && !in_place;
     if (! args_correct) {
         print_usage(argv[0]);
         EXIT_ERR;
     }
 
-    // Thought open() was clever when I first wrote it, now I wonder if it's
-    // misleading. We're technically opening the provided filename here,
-    // input_file and output_file just store the result of that operation
-    open(&input_file, argv[1], "r");
-    open(&output_file, argv[2], "w");
+    if (splitting_fields() && options.field_separator == options.delimiter) {
+        fprintf(stderr, "The field separator can't be the delimiter too\n");
+        EXIT_ERR;
+    }
+    // The long-line file is reversed a piece at a time from its end, which
+    // fields don't survive.
+    if (splitting_fields() && max_line_memory) {
+        fprintf(stderr, "--max-line-memory can't be used with fields\n");
+        EXIT_ERR;
+    }
+
+    if (reverse_init(&reverser, &options) != 0) {
+        perror("reverse_init");
+        EXIT_ERR;
+    }
+
+    if (verifying) prepare_verify();
+    if (plan_text) run_plan(argv[first_arg]);
+    if (serve_path) serve();
+    if (in_place) {
+        reverse_file_in_place(argv[first_arg]);
+        EXIT_SUCC;
+    }
+
+    if (batch_mode) reverse_batch(argv + first_arg, argc - first_arg);
+
+    // Thought open_file() was clever when I first wrote it, now I wonder if
+    // it's misleading. We're technically opening the provided filename here,
+    // input_file and output_file just store the result of that operation.
+    // --bench opens its own files, and only the runs it forks come back.
+    if (bench_mode) {
+        run_benchmarks();
+    } else {
+        if (tiny_file_applies()
+            && reverse_tiny_file(argv[first_arg], argv[first_arg + 1])) {
+            EXIT_SUCC;
+        }
+        open_file(&input_file, argv[first_arg], "r");
+        if (range_given && !part_output)
+            open_shared_output(argv[first_arg + 1]);
+        else
+            open_file(&output_file, argv[first_arg + 1], "w");
+    }
+    if (range_given) prepare_range();
+    prepare_compression();
+    prepare_cache_hints();
+    prepare_splice_output();
+    allocate_output_buffer();
+
+    if (tac_mode) {
+        reverse_line_order();
+        EXIT_SUCC;
+    }
+    if (use_stdio && stdio_applies()) {
+        reverse_with_stdio();
+        EXIT_SUCC;
+    }
+
+#ifdef HAVE_IO_URING
+    // The io_uring backend collects each block's output before writing it,
+    // so a line memory cap has the usual paths take over instead.
+    if (use_io_uring && !max_line_memory && reverse_with_io_uring()) {
+        EXIT_SUCC;
+    }
+#endif
+
+    // Regular files are mapped and walked in place; everything else goes
+    // through the block path. Both of them feed the same output
+    // buffer, which gets flushed once at the end. With -j, a mapped file is
+    // split up and handed to worker threads instead, which write around the
+    // buffer.
+    if (map_input() && thread_count > 1) {
+        reverse_in_parallel();
+        EXIT_SUCC;
+    }
+
+    prepare_direct_output();
+    if (input_map) {
+        while (find_region_lines())
+            reverse_region_lines();
+        flush_output();
+        EXIT_SUCC;
+    }
 
+    // The block path used to be just for pipe to pipe, with everything else
+    // going through getline(), which grew its buffer to fit the longest line
+    // it had seen. Now the blocks and the spill come from the buffer pool, and
+    // stdio is skipped entirely.
+    //
     // I come from a non-C programming background, so combining the stateful
-    // operation of getting the next line with checking an end-of-input
+    // operation of getting the next block with checking an end-of-input
     // condition still kind of bothers me. It's a common C idiom though, and it
     // fixes a particularly tricky bug I spent much too long trying to
     // fix after writing it the non-C way
-    while (get_next_line() != END_OF_INPUT) {
-        reverse_line();
-        output_line();
-    }
+    allocate_input_block();
+    size_t got;
+    while ((got = read_input_block()))
+        push_block(input_block, got, output_stream, NULL);
+    finish_stream(output_stream, NULL);
 
+    flush_output();
     EXIT_SUCC;
 }
 
@@ -182,7 +4647,14 @@ int main(int argc, char *argv[]) {
 
 /* The code in this file compiles to an executable which takes an input filename
  * and an output filename. It reads each line in the input file, reverses it,
- * and writes it to the output file.
+ * and writes it to the output file. The reversing itself lives in
+ * libreverse.c, which other programs can link against as well.
+ *
+ * Build with: cc -O2 -pthread -o reverse reverse.c libreverse.c
+ * and add -DHAVE_ZLIB -lz and/or -DHAVE_ZSTD -lzstd for .gz and .zst files.
+ * For callers that start it many times a second, add -static, which saves
+ * the dynamic loader's work on every start (see reverse_tiny_file).
+ * Benchmark with: ./reverse --bench (see run_benchmarks for the options)
  *
  * This code exists as part of the application process for a Quantiq Partners
  * position. I am applying for the System Administrator role.